@@ -3,6 +3,19 @@
 #include <stdio.h>     // For fprintf(stderr) error printing
 #include <unistd.h>    // For usleep() to throttle FPS (microseconds delay)
 #include <math.h>
+#include <stdint.h>    // For uint32_t in the non-finite check, uint64_t RNG state
+#include <string.h>    // For memcpy() bit casts, strcmp() on arguments
+#include <pthread.h>   // Worker threads for the threaded and cell engines
+#include <time.h>      // For clock_gettime() in headless timing
+#include <ctype.h>     // For toupper() when printing golden tables
+#include <sys/wait.h>  // For waitpid() on the worker processes of a sweep
+#include <sys/mman.h>  // For shm_open() and mmap() of the live state export
+#include <fcntl.h>     // For the O_ flags of shm_open()
+#include <sys/stat.h>  // For fstat() on a mapped export
+#include <sys/socket.h> // UNIX-domain socket of the control channel
+#include <sys/un.h>    // For struct sockaddr_un
+#include <poll.h>      // Event loop of the control server
+#include <errno.h>     // For EINTR and EAGAIN on the control sockets
 
 // Constants for window size and timing
 #define WIDTH 1000      // Window width in pixels
@@ -10,29 +23,5312 @@
 #define FPS_DELAY 33333  // Delay in microseconds: ~30 FPS (1000000 / 30 ≈ 33333)
 #define DEBUG 0
 
-#define NUM_PARTICLES 600
+#define NUM_PARTICLES 600   // Default particle count
 #define COEFFICIENT 5 * 1e-3
-#define SQUARED_RADIUS_MIN 100
+#define SQUARED_RADIUS_MIN 100   // Default of params.radius_min_squared, the squared core radius
+#define NUM_TYPES 3
 
-typedef struct particle {
-    int type;    
+// Force kernel defaults
+#define SOFTENING 2.0f   // Plummer softening length eps in pixels: r^2 becomes r^2 + eps^2
+#define REPULSION 1.0f   // Core repulsion at contact, fades to 0 at sqrt(SQUARED_RADIUS_MIN)
+#define SIMD_WIDTH 8     // Accumulator lanes of the vectorised kernel (8 floats = one AVX register)
+#define CUTOFF 100.0f    // Interaction range of the cell-list engine, also its cell size
+#define THREADS 0        // Worker threads, 0: one per online CPU
+#define MAX_THREADS 64
+#define CELL_UPDATE CELLS_SORTED   // How the cell-list engine maintains its grid, see enum cell_update
+#define CELL_SLACK 4          // Free slots per cell left by a rebuild for particles moving in, plus 25%
+#define SPECIALISE 1     // 1: use the kernels specialised for the domain size when one matches
 
+// Domain sizes that get their own compile-time specialised kernels, as
+// X(width, height). A run on one of them has the periods folded into the
+// simd and cells kernels as constants; any other size uses the generic ones.
+#define KERNEL_DOMAINS(X) \
+    X(1000, 1000)         \
+    X(2000, 2000)         \
+    X(4000, 4000)
+
+// Integrator defaults, copied into params at startup
+#define INERTIAL 0       // 0: overdamped (force applied directly as displacement), 1: velocity Verlet
+#define TIME_STEP 1.0f   // Simulated time advanced by one step
+#define FRICTION 0.5f    // Velocity damping rate per unit of simulated time (inertial mode only)
+#define TEMPERATURE 0.0f // Thermal energy kT of the Brownian/Langevin noise, 0: deterministic
+
+// Time step control defaults, also set by --adaptive and --block-levels N
+#ifndef ADAPTIVE
+#define ADAPTIVE 0              // 1: pick dt every step from the largest force/velocity
+#endif
+#define DT_MIN 0.01f            // Lower clamp for adaptive and per-particle steps
+#define DT_MAX 4.0f             // Upper clamp, also the length of one block step
+#define MAX_DISPLACEMENT 1.0f   // Distance in pixels a particle may travel in one step
+#ifndef BLOCK_LEVELS
+#define BLOCK_LEVELS 0          // >0: per-particle power-of-two steps dt_max / 2^level, level < BLOCK_LEVELS
+#endif
+#define MAX_BLOCK_LEVELS 16     // A block step is 2^(levels - 1) ticks
+
+// Level of detail defaults: far-field coarse graining for the simd and
+// threaded engines with the overdamped integrator
+#define LOD 0                  // 1: replace tight, stable, isolated clusters by rigid aggregates
+#define LOD_LINK 15.0f         // Particles closer than this belong to the same cluster
+#define LOD_MIN_MEMBERS 8      // Smallest cluster worth aggregating
+#define LOD_RADIUS 25.0f       // Largest member distance from the centre of an aggregate
+#define LOD_SEPARATION 4.0f    // Anything closer to an aggregate's centre than this many radii expands it
+#define LOD_INTERVAL 10        // Steps between searches for new aggregates
+
+// Activity tracking defaults (overdamped integrator, not with LOD)
+#define SLEEP 0                  // 1: put settled particles to sleep and update them at a lower rate
+#define SLEEP_THRESHOLD 0.1f     // Distance per step below which a particle counts as quiet
+#define SLEEP_STEPS 20           // Quiet steps, without a moving neighbour, before a particle sleeps
+#define SLEEP_WAKE 20.0f         // A moving particle wakes every sleeper within this distance
+#define SLEEP_INTERVAL 8         // A sleeping particle gets a force and a step every SLEEP_INTERVAL steps
+
+// Diagnostics defaults: observables to monitor a run without rendering it
+#define DIAGNOSTICS 0            // Steps between two diagnostics records, 0: off
+#define DIAGNOSTICS_LINK 15.0f   // Cell size of the cluster estimate: touching occupied cells are one cluster
+
+// In-situ radial distribution function defaults
+#define RDF 0                  // Steps between two g(r) samples, 0: off
+#define RDF_RANGE 100.0f       // Largest separation binned (capped at half the domain)
+#define RDF_BINS 100           // Histogram bins over [0, RDF_RANGE)
+#define RDF_PATH "rdf.csv"     // Table of the running average, rewritten after every sample
+
+// In-situ cluster detection defaults
+#define CLUSTERING 0            // Steps between two cluster detections, 0: off
+#define CLUSTER_LINK 15.0f      // Particles closer than this belong to the same cluster
+#define CLUSTER_MIN_SIZE 8      // Smallest cluster reported
+#define TRACKING 0              // 1: follow the clusters from one detection to the next and report events
+#define TRACK_MIN_SHARED 4      // Members two clusters of consecutive detections share to be related
+
+// Parameter sweep defaults (--sweep SPEC): every combination of the values
+// listed in SPEC, each run headless in a process of its own
+#define SWEEP_JOBS 0                 // Runs at a time, 0: one per online CPU
+#define SWEEP_STEPS 1000             // Steps per run unless the spec sets them
+#define SWEEP_RESULTS "sweep.csv"    // One row per finished run; rows already there are not run again
+#define SWEEP_MAX_AXES 16            // Swept parameters
+#define SWEEP_MAX_VALUES 256         // Values per swept parameter
+
+// Live state export defaults (--export NAME): the positions, types and ids
+// published in a POSIX shared-memory segment that viewers map at their own
+// pace, see export_header
+#define EXPORT_INTERVAL 1        // Steps between two published frames
+#define EXPORT_RETRIES 1000      // Attempts of a reader at a frame the writer is not overwriting
+#define EXPORT_MAGIC 0x4546494cu // "LIFE" in memory on little-endian machines
+#define EXPORT_VERSION 2         // Bumped whenever the layout of the segment changes
+
+// Control channel defaults (--control PATH): line commands on a UNIX-domain
+// socket, served by a thread of their own, see control_execute()
+#define CONTROL_CLIENTS 16       // Connections served at once
+#define CONTROL_LINE 512         // Longest command or reply
+#define CONTROL_PAUSE_POLL 10000 // Microseconds between two looks at the commands while paused
+
+// Precision of the force sums. Pair forces are always evaluated in float
+// (sqrtf() and float constants, nothing is promoted to double); ACCUMULATE
+// picks how each particle's total over its lanes is kept:
+//   0  float lanes, the fastest
+//   1  double lanes, every float pair force widened before it is added
+//   2  float lanes with Kahan compensation
+// A compile-time choice (make CFLAGS=-DACCUMULATE=1) so the kernels carry
+// no switch per pair.
+#ifndef ACCUMULATE
+#define ACCUMULATE 0
+#endif
+
+// Validation of the particle state after every force pass. On by default in
+// debug builds; release builds (-DNDEBUG) turn it on through params.validate.
+#ifndef VALIDATE
+#ifdef NDEBUG
+#define VALIDATE 0
+#else
+#define VALIDATE 1
+#endif
+#endif
+#define MAX_SANITIZE_EVENTS 256   // Size of the ring buffer keeping the latest repairs
+
+// Initial condition defaults
+#define CLUSTERS 8             // Cluster centres of the clustered generator
+#define CLUSTER_SPREAD 30.0f   // Standard deviation of one cluster in pixels
+#define DISK_RADIUS 0.4f       // Radius of the disk generator, as a fraction of the smaller side
+
+// Golden regression runs (--verify)
+#define GOLDEN_STEPS 50     // Steps per golden run
+#define GOLDEN_SAMPLES 8    // Particles compared per run, spread evenly over the indices
+
+// Particle state, stored as one array per field (structure of arrays) so the
+// force kernel streams contiguous floats. Every array holds padded entries,
+// count rounded up to a multiple of SIMD_WIDTH; padding slots are never moved
+// and never exert a force.
+typedef struct particle_soa {
+    int count;
+    int padded;
+
+    int *type;
+
+    float *x;
+    float *y;
+
+    // Velocity: only carried by the inertial integrator
+    float *vx;
+    float *vy;
+
+    // Force from the last force pass (used as acceleration in inertial mode)
+    float *fx;
+    float *fy;
+
+    // Block time step level: the particle is advanced with DT_MAX / 2^level
+    int *level;
+
+    // Rigid aggregate the particle belongs to, -1 when free (level of detail mode)
+    int *aggregate;
+
+    // Activity tracking: distance per step moved in the last step, and the
+    // number of consecutive quiet steps (asleep from SLEEP_STEPS on)
+    float *moved;
+    int *quiet;
+
+    // Index the particle had when it was created. Sorting by cell permutes
+    // the arrays; everything keyed to a particle (random streams, golden
+    // samples) goes through its id.
+    int *id;
+} particle_soa;
+
+// Initial condition generators
+enum init_generator {
+    INIT_UNIFORM,     // Uniform over the domain
+    INIT_CLUSTERED,   // Gaussian blobs around random centres
+    INIT_DISK,        // Uniform inside a centred disk
+    INIT_LATTICE,     // Square lattice filling the domain
+    INIT_FILE,        // Read from params.load_path
+    NUM_GENERATORS
+};
+
+const char *generator_names[NUM_GENERATORS] = { "uniform", "clustered", "disk", "lattice", "file" };
+
+// Force kernels
+enum engine {
+    ENGINE_SCALAR,     // Plain pair loop, reference for the others
+    ENGINE_SIMD,       // Branch-free lane-split loop (default)
+    ENGINE_THREADED,   // ENGINE_SIMD with the particles split across threads
+    ENGINE_CELLS,      // Cell list, pairs beyond CUTOFF ignored
+    NUM_ENGINES
+};
+
+const char *engine_names[NUM_ENGINES] = { "scalar", "simd", "threaded", "cells" };
+
+// Grid maintenance of the cell-list engine
+enum cell_update {
+    CELLS_REBUILD,       // Counting-sort rebuild of the cell index every pass
+    CELLS_INCREMENTAL,   // Move only the particles that changed cell
+    CELLS_SORTED,        // Parallel counting sort of the particle arrays themselves, so cells are contiguous
+    CELLS_SPECIES,       // As CELLS_SORTED, then by species within each cell, for the species block kernel
+    NUM_CELL_UPDATES
+};
+
+const char *cell_update_names[NUM_CELL_UPDATES] = { "rebuild", "incremental", "sorted", "species" };
+
+typedef struct sim_params {
+    int inertial;     // Integrator selection, see INERTIAL
+    float dt;         // Time step
+    float friction;   // Damping rate, velocity decays as exp(-friction * t)
+    float temperature;        // See TEMPERATURE
+
+    int adaptive;             // See ADAPTIVE
+    float dt_min;             // See DT_MIN
+    float dt_max;             // See DT_MAX
+    float max_displacement;   // See MAX_DISPLACEMENT
+    int block_levels;         // See BLOCK_LEVELS
+
+    int engine;               // Force kernel, see enum engine
+    float softening;          // See SOFTENING
+    float repulsion;          // See REPULSION
+    float radius_min_squared; // See SQUARED_RADIUS_MIN
+
+    int validate;             // See VALIDATE
+    int lod;                  // See LOD
+    int sleep;                // See SLEEP
+    int diagnostics;          // See DIAGNOSTICS
+    int rdf;                  // See RDF
+    int clustering;           // See CLUSTERING
+    int tracking;             // See TRACKING
+    int export_interval;      // See EXPORT_INTERVAL
+
+    float cutoff;             // See CUTOFF
+    int threads;              // See THREADS
+    int specialise;           // See SPECIALISE
+    int cell_update;          // See CELL_UPDATE
+
+    int num_particles;        // See NUM_PARTICLES
+    float width;              // Domain size, WIDTH x HEIGHT (the window) by default
+    float height;
+    int init;                 // Initial condition, see enum init_generator
+    int clusters;             // See CLUSTERS
+    float cluster_spread;     // See CLUSTER_SPREAD
+    float mix[NUM_TYPES];     // Species fractions (any scale); all 0: types cycle 0, 1, 2, ...
+    const char *load_path;    // Particle file for INIT_FILE, lines of "x y type"
+    const char *diagnostics_path;   // Diagnostics stream, CSV when it ends in ".csv" and ndjson otherwise; NULL: stdout
+    const char *rdf_path;           // See RDF_PATH
+    const char *clustering_path;    // Cluster stream, CSV or ndjson like diagnostics_path; NULL: stdout
+    const char *tracking_path;      // Event stream of the cluster tracks, same formats; NULL: stdout
+    const char *export_name;        // Shared-memory segment of the live export, NULL: none
+    const char *control_path;       // Socket of the control channel, NULL: none
+} sim_params;
+
+// One repaired particle: the step it happened in, the particle, and the
+// partner it was closest to when its force went bad (-1 if its own position
+// was already non-finite, so no partner can be identified). Both are
+// particle ids, since the cell engine reorders the arrays.
+typedef struct sanitize_event {
+    long step;
+    int particle;
+    int partner;
+} sanitize_event;
+
+// Uniform grid for the cell-list engine. Cell c owns the slots
+// cell_particles[cell_start[c] .. cell_start[c + 1]), of which the particles
+// fill [cell_start[c], cell_end[c]) and the rest are free. A counting-sort
+// rebuild lays the cells out in index order; incremental maintenance then
+// moves only the particles that crossed a cell boundary, and rebuilds (which
+// compacts and hands out fresh slack) when a cell runs out of free slots.
+typedef struct cell_grid {
+    int cells_x;
+    int cells_y;
+    int *cell_start;        // cells_x * cells_y + 1 entries
+    int *cell_end;          // cells_x * cells_y entries
+    int *species_start;     // cells_x * cells_y * NUM_TYPES + 1 entries: species s of cell c starts at
+                            // species_start[c * NUM_TYPES + s] after a species sort
+    int *cell_particles;    // capacity entries
+    int capacity;
+    int *particle_cell;     // particles.count entries
+    int *particle_slot;     // Index of each particle in cell_particles
+    int stale;              // Set when particles were reallocated: next update rebuilds
+    long rebuilds;          // Number of counting-sort rebuilds so far
+} cell_grid;
+
+// Cluster replaced by a rigid body in level of detail mode. Its members keep
+// their places relative to the centre and all move with the same velocity:
+// the mean force they feel from outside plus the mean force they exerted on
+// each other when the aggregate formed (not zero in general, since the
+// interaction matrix is not symmetric).
+typedef struct aggregate {
     float x;
     float y;
-} particle;
+    float radius;            // Largest member distance from the centre
+    float drift_x;           // Frozen mean internal force
+    float drift_y;
+    float fx;                // Force per member from this force pass
+    float fy;
+    int members;
+    int count[NUM_TYPES];    // Members per species
+    int expand;              // Set when the aggregate is disturbed
+} aggregate;
+
+// Stored result of one golden run: where GOLDEN_SAMPLES evenly spaced
+// particles are after GOLDEN_STEPS steps from a seed. tolerance is the
+// largest accepted distance in pixels; it absorbs what compiler flags (FMA
+// contraction, vector width) change in the last bits, amplified by the run.
+typedef struct golden_case {
+    int engine;
+    int inertial;
+    unsigned seed;
+    float tolerance;
+    float x[GOLDEN_SAMPLES];
+    float y[GOLDEN_SAMPLES];
+} golden_case;
+
+particle_soa particles;
+cell_grid grid;
+cell_grid wake_grid;   // Grid of SLEEP_WAKE cells for activity tracking
+cell_grid rdf_grid;    // Grid of the g(r) neighbour search
+cell_grid cluster_grid;   // Grid of CLUSTER_LINK cells for cluster detection
+const sim_params default_params = { INERTIAL, TIME_STEP, FRICTION, TEMPERATURE,
+                                    ADAPTIVE, DT_MIN, DT_MAX, MAX_DISPLACEMENT, BLOCK_LEVELS,
+                                    ENGINE_SIMD, SOFTENING, REPULSION, SQUARED_RADIUS_MIN,
+                                    VALIDATE, LOD, SLEEP, DIAGNOSTICS, RDF, CLUSTERING, TRACKING, EXPORT_INTERVAL,
+                                    CUTOFF, THREADS, SPECIALISE, CELL_UPDATE,
+                                    NUM_PARTICLES, WIDTH, HEIGHT, INIT_UNIFORM, CLUSTERS, CLUSTER_SPREAD,
+                                    { 0 }, NULL, NULL, RDF_PATH, NULL, NULL, NULL, NULL };
+sim_params params;
+
+// Species interaction matrix: interaction[a][b] scales the force a particle of
+// type b exerts on one of type a; positive pushes apart, negative attracts
+float interaction[NUM_TYPES][NUM_TYPES] = {
+    {  1e4, -1e4,  1e4 },
+    {  1e4, -1e4, -1e4 },
+    { -1e4,  1e4, -1e4 },
+};
+
+// species_coef[t][j] = interaction[t][type of j], rebuilt by prepare_forces()
+float *species_coef[NUM_TYPES];
+float inv_core_radius;
+float softening_squared;
+
+double sim_time = 0;   // Simulated time elapsed
+long step_count = 0;   // Number of completed steps
+float sleeping_fraction = 0;   // Share of the particles asleep after the last step
+double cell_seconds = 0;       // Time spent maintaining the cell-list engine's grid
+float last_dt = 0;     // Step used by the last global step (smallest level step in block mode)
+
+sanitize_event sanitize_log[MAX_SANITIZE_EVENTS];   // Ring buffer, see sanitize_count
+long sanitize_count = 0;                            // Total repairs since startup
+
+uint64_t sim_seed = 42;   // Seed of the current run, every random stream derives from it
+uint64_t noise_key;       // Key of the thermal noise stream, set with the seed
+uint64_t noise_pass = 0;  // Noise draws so far; each pass uses fresh counters for every particle
+
+// What a random stream is used for; part of its key so that, say, the
+// placement and the respawn numbers of one particle never coincide
+enum rng_purpose {
+    RNG_PLACEMENT,
+    RNG_RESPAWN,
+    RNG_NOISE,
+    RNG_CLUSTERS
+};
+
+// SplitMix64 finaliser: a bijective 64-bit mix with good avalanche
+static inline uint64_t splitmix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Key of one independent stream, identified by the seed, its purpose and an
+// index (a particle for per-particle streams, a thread for per-thread ones)
+static inline uint64_t rng_key(uint64_t seed, int purpose, uint64_t index) {
+    return splitmix64(splitmix64(seed + 0x9e3779b97f4a7c15ull * (uint64_t)(purpose + 1)) ^ index);
+}
+
+// Counter-based generator: the n-th number of a stream is a pure function of
+// (key, n), the SplitMix64 sequence started at key. No shared state, so any
+// thread can draw any particle's numbers and the result never depends on
+// the thread count or on scheduling.
+static inline uint64_t rng_at(uint64_t key, uint64_t counter) {
+    return splitmix64(key + counter * 0x9e3779b97f4a7c15ull);
+}
+
+// Uniform float in [0, 1) from the top 24 bits
+static inline float rng_float(uint64_t bits) {
+    return (bits >> 40) * 0x1p-24f;
+}
+
+// Two independent standard normal numbers from two uniform draws (Box-Muller).
+// Branch-free; 1 - u keeps the logarithm away from 0.
+static inline void rng_gaussian2(uint64_t a, uint64_t b, float *g0, float *g1) {
+    float radius = sqrtf(-2.0f * logf(1.0f - rng_float(a)));
+    float angle = 6.28318531f * rng_float(b);
+    *g0 = radius * cosf(angle);
+    *g1 = radius * sinf(angle);
+}
+
+// Approximately standard normal number from 64 random bits: the sum of four
+// 16-bit uniforms, centred and scaled to unit variance (Irwin-Hall). Integer
+// and float arithmetic only, so loops drawing it vectorise where Box-Muller's
+// log/sin/cos do not. Tails stop at +-2 sqrt(3), which thermal noise summed
+// over many steps does not notice.
+static inline float rng_normal(uint64_t bits) {
+    float sum = (float)(bits & 0xffff) + (float)((bits >> 16) & 0xffff)
+              + (float)((bits >> 32) & 0xffff) + (float)(bits >> 48);
+    return ((sum + 2.0f) * (1.0f / 65536.0f) - 2.0f) * 1.7320508f;
+}
+
+// Sequential view of a stream, e.g. one per thread for stochastic forcing
+typedef struct rng_stream {
+    uint64_t key;
+    uint64_t counter;
+} rng_stream;
+
+static inline rng_stream rng_stream_init(uint64_t seed, int purpose, uint64_t index) {
+    rng_stream stream = { rng_key(seed, purpose, index), 0 };
+    return stream;
+}
+
+static inline uint64_t rng_next(rng_stream *stream) {
+    return rng_at(stream->key, stream->counter++);
+}
+
+// Minimum-image separation along one periodic axis. Positions stay inside
+// [0, period), so one compare-and-select per side is enough (no branches,
+// no rounding calls, which keeps the loops below vectorisable).
+static inline float min_image(float d, float period) {
+    d -= (d > 0.5f * period) ? period : 0.0f;
+    d += (d < -0.5f * period) ? period : 0.0f;
+    return d;
+}
+
+// Periods from the domain within which wrap_coordinate() is exact; further
+// out the rounding of v / period and of the product grows past a period
+// (and v / period can overflow), see wrap_coordinate_exact()
+#define WRAP_PERIODS 4096.0f
+
+// Maps v into [0, period) however many periods it is away, up to
+// WRAP_PERIODS. One floorf() replaces repeated add/subtract and fmodf() (a
+// libm call that does not vectorise, while floorf() becomes a rounding
+// instruction once -fno-trapping-math is on); the two selects catch the
+// results that rounding of v / period can push to exactly period or just
+// below 0.
+static inline float wrap_coordinate(float v, float period) {
+    v -= period * floorf(v * (1.0f / period));
+    v += (v < 0.0f) ? period : 0.0f;
+    return (v < period) ? v : v - period;
+}
+
+// wrap_coordinate() for any finite v: values WRAP_PERIODS or more periods
+// out take the exact fmodf() first. Not for vectorised loops, see
+// wrap_positions().
+static inline float wrap_coordinate_exact(float v, float period) {
+    if(fabsf(v) >= WRAP_PERIODS * period) v = fmodf(v, period);
+    return wrap_coordinate(v, period);
+}
+
+// Force that particle j exerts on particle i, for separation (dx, dy) = i - j
+// and species coefficient coef (> 0 repulsive, < 0 attractive).
+// The species force is Plummer-softened, coef * COEFFICIENT * d / (r^2 + eps^2)^(3/2),
+// so it stays bounded when two particles meet. Inside the core radius
+// sqrt(SQUARED_RADIUS_MIN) it is faded out linearly and replaced by a species
+// independent repulsion ramping up to params.repulsion at contact. Both pieces
+// are selected by a clamp rather than a branch. Coincident particles (and
+// j == i) have d = 0 and contribute exactly zero.
+//
+// pair_terms() also hands out the pair's potential for the force passes of
+// diagnostics record steps, in the form the vector lanes can sum from the
+// same distance: pair_potential() without the logarithm of its in-core
+// species term, species * core + repulsion * c (1 - core)^2 / 2 with the
+// clamped core = s / c, in *potential, and that core in *core_out. The
+// logarithm is zero outside the core (core 1); for the pairs inside it
+// potential_fixup() adds it. pair_force() drops both, which costs nothing
+// once inlined.
+static inline void pair_terms(float dx, float dy, float coef, float *fx, float *fy, float *potential, float *core_out) {
+    float r_squared = dx * dx + dy * dy + softening_squared;
+    float inv_r = 1.0f / sqrtf(r_squared);
+    float core = r_squared * inv_r * inv_core_radius;
+    core = core < 1.0f ? core : 1.0f;   // Select rather than fminf(), whose NaN rules block vectorisation
+    float fade = 1.0f - core;
+
+    // COEFFICIENT is a double literal; the cast keeps the whole kernel in float
+    float species = coef * (float)(COEFFICIENT) * inv_r;
+    float magnitude = species * inv_r * inv_r * core + params.repulsion * fade * inv_r;
+    *fx = magnitude * dx;
+    *fy = magnitude * dy;
+    *potential = species * core + 0.5f * params.repulsion / inv_core_radius * fade * fade;
+    *core_out = core;
+}
+
+static inline void pair_force(float dx, float dy, float coef, float *fx, float *fy) {
+    float potential, core;
+    pair_terms(dx, dy, coef, fx, fy, &potential, &core);
+}
+
+// Potential of the pair force above, zero at infinite separation, so that
+// pair_force() is minus its gradient with respect to (dx, dy). With the
+// softened distance s = sqrt(r^2 + eps^2) and the core radius c:
+//   s >= c: coef * COEFFICIENT / s
+//   s <  c: coef * COEFFICIENT / c * (1 + ln(c / s)) + repulsion * (c - s)^2 / (2 c)
+static inline float pair_potential(float dx, float dy, float coef) {
+    float s = sqrtf(dx * dx + dy * dy + softening_squared);
+    float c = 1.0f / inv_core_radius;
+    float species = coef * (float)(COEFFICIENT);
+    if(s >= c) return species / s;
+    return species * inv_core_radius * (1.0f + logf(c / s)) + 0.5f * params.repulsion * (c - s) * (c - s) * inv_core_radius;
+}
+
+// Type of the running force sums, see ACCUMULATE
+#if ACCUMULATE == 1
+typedef double accumulator;
+#else
+typedef float accumulator;
+#endif
+
+// SIMD_WIDTH independent partial sums of one particle's force. Zero
+// initialise, add with lane_add() and reduce with lanes_total().
+typedef struct force_lanes {
+    accumulator x[SIMD_WIDTH];
+    accumulator y[SIMD_WIDTH];
+    float carry_x[SIMD_WIDTH];   // Low-order bits lost by each lane so far (ACCUMULATE 2 only)
+    float carry_y[SIMD_WIDTH];
+} force_lanes;
+
+static inline __attribute__((always_inline)) void lane_add(force_lanes *acc, int l, float fx, float fy) {
+#if ACCUMULATE == 2
+    float term_x = fx - acc->carry_x[l];
+    float term_y = fy - acc->carry_y[l];
+    float sum_x = acc->x[l] + term_x;
+    float sum_y = acc->y[l] + term_y;
+    acc->carry_x[l] = (sum_x - acc->x[l]) - term_x;
+    acc->carry_y[l] = (sum_y - acc->y[l]) - term_y;
+    acc->x[l] = sum_x;
+    acc->y[l] = sum_y;
+#else
+    acc->x[l] += fx;
+    acc->y[l] += fy;
+#endif
+}
+
+// Sum of the lanes in the accumulator precision, rounded to float once
+static inline __attribute__((always_inline)) void lanes_total(const force_lanes *acc, float *out_x, float *out_y) {
+    accumulator new_x = 0;
+    accumulator new_y = 0;
+    for(int l = 0; l < SIMD_WIDTH; l++) {
+        new_x += acc->x[l] - acc->carry_x[l];
+        new_y += acc->y[l] - acc->carry_y[l];
+    }
+    *out_x = (float)new_x;
+    *out_y = (float)new_y;
+}
+
+// Pair potential of one particle, gathered by the force kernels on record
+// steps: the lane terms of pair_terms() in SIMD_WIDTH lanes (the particle
+// itself included, which potential_total() takes out again) and the
+// corrections of potential_fixup() in core. Zero initialise but for self
+// and count.
+typedef struct potential_lanes {
+    float lanes[SIMD_WIDTH];
+    double core;
+    int self;
+    int count;   // Slots from here on are padding
+} potential_lanes;
+
+// Correction for source j with the clamped core pair_terms() gave it (1 for
+// a pair beyond the cutoff), for the rare blocks with a pair in the core:
+// the logarithm the lanes left out, coef * COEFFICIENT / c * ln(c / s), or
+// the whole lane term of a padding slot (coefficient zero). The kernels keep
+// the cores of a block and add it up for each of its pairs.
+static inline float potential_fixup(const potential_lanes *pot, int j, float core, float coef) {
+    if(core >= 1.0f || j == pot->self) return 0.0f;
+    if(j >= pot->count) return -0.5f * params.repulsion / inv_core_radius * (1.0f - core) * (1.0f - core);
+    return -coef * (float)(COEFFICIENT) * inv_core_radius * logf(core);
+}
+
+// The particle's potential: the lanes and corrections, less the lane term
+// of its own pair (coefficient self_coef at zero separation)
+static inline double potential_total(const potential_lanes *pot, float self_coef) {
+    float fx, fy, self, core;
+    pair_terms(0.0f, 0.0f, self_coef, &fx, &fy, &self, &core);
+    double sum = pot->core - self;
+    for(int l = 0; l < SIMD_WIDTH; l++) sum += pot->lanes[l];
+    return sum;
+}
+
+// Reference kernel: sums the pair forces acting on particle i into its fx/fy,
+// one pair at a time. Kept deliberately plain to check the vectorised kernel.
+void compute_force_scalar(int i) {
+    accumulator new_x = 0;
+    accumulator new_y = 0;
+
+    for(int j = 0; j < particles.count; j++) {
+        if(j == i) continue;
+
+        float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+        float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+        float fx, fy;
+        pair_force(x_pos, y_pos, interaction[particles.type[i]][particles.type[j]], &fx, &fy);
+
+        new_x += fx;
+        new_y += fy;
+    }
+    particles.fx[i] = (float)new_x;
+    particles.fy[i] = (float)new_y;
+}
+
+// Sum of the forces that padded sources at (x, y) with coefficients coef
+// exert on a point (xi, yi). The j loop runs over SIMD_WIDTH independent
+// accumulator lanes (float sums may not be reordered by the compiler, so the
+// lanes make the reduction explicit) and reads one coefficient per source,
+// so the inner loop is straight-line loads and arithmetic. Always inlined,
+// so callers passing constant periods get them folded in (see KERNEL_DOMAINS),
+// and callers passing pot == NULL get the potential terms dropped.
+static inline __attribute__((always_inline)) void simd_sum(float xi, float yi, const float *x, const float *y,
+                                                           const float *coef, int padded, float width, float height,
+                                                           float *out_x, float *out_y, potential_lanes *pot) {
+    force_lanes acc = { 0 };
+    float lanes[SIMD_WIDTH] = { 0 };   // Kept local, pot->lanes could alias the positions
+    double fixup = 0.0;
+
+    for(int j = 0; j < padded; j += SIMD_WIDTH) {
+        float core[SIMD_WIDTH];
+        int in_core = 0;
+        for(int k = 0; k < SIMD_WIDTH; k++) {
+            float x_pos = min_image(xi - x[j + k], width);
+            float y_pos = min_image(yi - y[j + k], height);
+            float fx, fy, potential;
+            pair_terms(x_pos, y_pos, coef[j + k], &fx, &fy, &potential, &core[k]);
+            lane_add(&acc, k, fx, fy);
+            lanes[k] += potential;
+            in_core |= core[k] < 1.0f;
+        }
+        if(!pot || !in_core) continue;
+        for(int k = 0; k < SIMD_WIDTH; k++) fixup += potential_fixup(pot, j + k, core[k], coef[j + k]);
+    }
+    lanes_total(&acc, out_x, out_y);
+    if(!pot) return;
+    for(int k = 0; k < SIMD_WIDTH; k++) pot->lanes[k] += lanes[k];
+    pot->core += fixup;
+}
+
+// Vectorised kernel: same forces as compute_force_scalar, summed by
+// simd_sum() with the coefficients from species_coef instead of indexing the
+// matrix. Padding slots past particles.count have a zero coefficient and sit
+// at the origin, and i itself contributes zero, so no lane needs masking.
+static inline __attribute__((always_inline)) void simd_kernel(int i, float width, float height, potential_lanes *pot) {
+    simd_sum(particles.x[i], particles.y[i], particles.x, particles.y, species_coef[particles.type[i]],
+             particles.padded, width, height, &particles.fx[i], &particles.fy[i], pot);
+}
+
+void compute_force_simd(int i) {
+    simd_kernel(i, params.width, params.height, NULL);
+}
+
+// Number of worker threads to use
+int thread_count() {
+    int threads = params.threads > 0 ? params.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+    return threads;
+}
+
+// Work on [begin, end), run by thread number thread
+typedef void (*range_fn)(long begin, long end, int thread, void *ctx);
+
+typedef struct range_job {
+    range_fn fn;
+    void *ctx;
+    long begin;
+    long end;
+    int thread;
+} range_job;
+
+void *range_worker(void *arg) {
+    range_job *job = arg;
+    job->fn(job->begin, job->end, job->thread, job->ctx);
+    return NULL;
+}
+
+// Splits [0, count) into one contiguous chunk per thread and runs fn on all
+// of them, the calling thread taking chunk 0. Returns once every chunk is
+// done. Chunk boundaries depend only on count and the thread count, so
+// results do not depend on scheduling.
+void parallel_for(long count, range_fn fn, void *ctx) {
+    int threads = thread_count();
+    if(threads > count) threads = count > 0 ? (int)count : 1;
+
+    pthread_t workers[MAX_THREADS];
+    int started[MAX_THREADS] = { 0 };
+    range_job jobs[MAX_THREADS];
+    for(int t = 0; t < threads; t++) {
+        jobs[t].fn = fn;
+        jobs[t].ctx = ctx;
+        jobs[t].begin = count * t / threads;
+        jobs[t].end = count * (t + 1) / threads;
+        jobs[t].thread = t;
+    }
+
+    for(int t = 1; t < threads; t++) started[t] = pthread_create(&workers[t], NULL, range_worker, &jobs[t]) == 0;
+    range_worker(&jobs[0]);
+    for(int t = 1; t < threads; t++) {
+        // A thread we could not start runs here instead
+        if(started[t]) pthread_join(workers[t], NULL);
+        else range_worker(&jobs[t]);
+    }
+}
+
+// Cell of a position along one axis; positions equal to the period (possible
+// before the first wrap) land in the last cell
+static inline int cell_coordinate(float v, float period, int cells) {
+    int c = (int)(v * cells / period);
+    return c < cells ? c : cells - 1;
+}
+
+// Sets the dimensions of grid g for cells at least cell_size wide,
+// reallocating the per-cell arrays when they change
+void size_grid(cell_grid *g, float cell_size) {
+    int cells_x = (int)(params.width / cell_size);
+    int cells_y = (int)(params.height / cell_size);
+    if(cells_x < 1) cells_x = 1;
+    if(cells_y < 1) cells_y = 1;
+    if(cells_x == g->cells_x && cells_y == g->cells_y && g->cell_start) return;
+
+    free(g->cell_start);
+    free(g->cell_end);
+    free(g->species_start);
+    g->cells_x = cells_x;
+    g->cells_y = cells_y;
+    g->cell_start = malloc(sizeof(int) * (cells_x * cells_y + 1));
+    g->cell_end = malloc(sizeof(int) * cells_x * cells_y);
+    g->species_start = malloc(sizeof(int) * ((long)cells_x * cells_y * NUM_TYPES + 1));
+    if(!g->cell_start || !g->cell_end || !g->species_start) {
+        fprintf(stderr, "Cannot allocate %d x %d cell grid\n", cells_x, cells_y);
+        exit(1);
+    }
+}
+
+// Grows the slot array of grid g to at least slots entries
+void reserve_slots(cell_grid *g, int slots) {
+    if(g->capacity >= slots) return;
+    free(g->cell_particles);
+    g->capacity = slots;
+    g->cell_particles = malloc(sizeof(int) * g->capacity);
+    if(!g->cell_particles) {
+        fprintf(stderr, "Cannot allocate %d cell slots\n", g->capacity);
+        exit(1);
+    }
+}
+
+// Counting-sort rebuild of grid g with cells at least cell_size wide:
+// histogram of particles per cell, prefix sum of the counts plus free slots
+// (slack and a quarter of the count, when slack is not 0) into cell_start,
+// then scatter in index order (stable, so the result is the same every time
+// for the same positions)
+void build_cells(cell_grid *g, float cell_size, int slack) {
+    size_grid(g, cell_size);
+    int cells_x = g->cells_x;
+    int cells_y = g->cells_y;
+    int cells = cells_x * cells_y;
+    memset(g->cell_start, 0, sizeof(int) * (cells + 1));
+    for(int i = 0; i < particles.count; i++) {
+        int c = cell_coordinate(particles.y[i], params.height, cells_y) * cells_x
+              + cell_coordinate(particles.x[i], params.width, cells_x);
+        g->particle_cell[i] = c;
+        g->cell_start[c + 1]++;
+    }
+    for(int c = 0; c < cells; c++) {
+        int count = g->cell_start[c + 1];
+        g->cell_start[c + 1] = g->cell_start[c] + count + (slack ? slack + count / 4 : 0);
+    }
+
+    reserve_slots(g, g->cell_start[cells]);
+    memcpy(g->cell_end, g->cell_start, sizeof(int) * cells);
+    for(int i = 0; i < particles.count; i++) {
+        int slot = g->cell_end[g->particle_cell[i]]++;
+        g->cell_particles[slot] = i;
+        g->particle_slot[i] = slot;
+    }
+    g->stale = 0;
+    g->rebuilds++;
+}
+
+// Incremental maintenance of grid g: particles move much less than a cell
+// per step, so most stay put and the rest are moved with a swap-remove from
+// their old cell and an append to the new one. Falls back to a rebuild on
+// the first pass, after a change of the grid size, or when a cell is full.
+// The order within a cell then depends on the history, which only changes
+// the rounding of the cell kernel's sums.
+void update_cells(cell_grid *g, float cell_size) {
+    int cells_x = (int)(params.width / cell_size);
+    int cells_y = (int)(params.height / cell_size);
+    if(cells_x < 1) cells_x = 1;
+    if(cells_y < 1) cells_y = 1;
+    if(g->stale || cells_x != g->cells_x || cells_y != g->cells_y || !g->cell_start) {
+        build_cells(g, cell_size, CELL_SLACK);
+        return;
+    }
+
+    for(int i = 0; i < particles.count; i++) {
+        int c = cell_coordinate(particles.y[i], params.height, cells_y) * cells_x
+              + cell_coordinate(particles.x[i], params.width, cells_x);
+        int old = g->particle_cell[i];
+        if(c == old) continue;
+        if(g->cell_end[c] == g->cell_start[c + 1]) {
+            build_cells(g, cell_size, CELL_SLACK);
+            return;
+        }
+
+        int last = g->cell_particles[--g->cell_end[old]];
+        g->cell_particles[g->particle_slot[i]] = last;
+        g->particle_slot[last] = g->particle_slot[i];
+
+        g->particle_slot[i] = g->cell_end[c]++;
+        g->cell_particles[g->particle_slot[i]] = i;
+        g->particle_cell[i] = c;
+    }
+}
+
+// Brings the index of grid g up to date with the positions, incrementally
+// when params.cell_update asks for it and by a full rebuild otherwise
+void refresh_cells(cell_grid *g, float cell_size) {
+    if(params.cell_update == CELLS_INCREMENTAL) update_cells(g, cell_size);
+    else build_cells(g, cell_size, 0);
+}
+
+// Every per-particle array, all with 4-byte elements, which sort_cells()
+// permutes together (the grid's particle_cell included)
+#define NUM_PARTICLE_FIELDS 13
+uint32_t **const particle_fields[NUM_PARTICLE_FIELDS] = {
+    (uint32_t **)&particles.type, (uint32_t **)&particles.x, (uint32_t **)&particles.y,
+    (uint32_t **)&particles.vx, (uint32_t **)&particles.vy, (uint32_t **)&particles.fx, (uint32_t **)&particles.fy,
+    (uint32_t **)&particles.level, (uint32_t **)&particles.aggregate, (uint32_t **)&particles.moved,
+    (uint32_t **)&particles.quiet, (uint32_t **)&particles.id, (uint32_t **)&grid.particle_cell
+};
+
+// Second buffer of every field: the sort scatters into it, then swaps
+uint32_t *sort_scratch[NUM_PARTICLE_FIELDS];
+int *sort_destination;   // Slot each particle moves to
+
+// Shared state of one parallel sort
+typedef struct cell_sort {
+    cell_grid *g;
+    int species;      // Sort keys per cell: NUM_TYPES to order each cell by species, else 1
+    long keys;        // cells * species
+    int *histogram;   // One row of keys counters per thread
+} cell_sort;
+
+// Sort key of particle i, whose cell is already in particle_cell
+static inline long sort_key(const cell_sort *sort, long i) {
+    long key = (long)sort->g->particle_cell[i] * sort->species;
+    return sort->species > 1 ? key + particles.type[i] : key;
+}
+
+// Pass 1 of the sort: cell of every particle in this thread's chunk and the
+// chunk's histogram
+void sort_histogram(long begin, long end, int thread, void *ctx) {
+    cell_sort *sort = ctx;
+    cell_grid *g = sort->g;
+    int *histogram = sort->histogram + thread * sort->keys;
+    memset(histogram, 0, sizeof(int) * sort->keys);
+    for(long i = begin; i < end; i++) {
+        g->particle_cell[i] = cell_coordinate(particles.y[i], params.height, g->cells_y) * g->cells_x
+                            + cell_coordinate(particles.x[i], params.width, g->cells_x);
+        histogram[sort_key(sort, i)]++;
+    }
+}
+
+// Pass 2: every particle of the chunk to its slot (the histogram row now
+// holds this thread's first slot for each key), then one field at a time
+// into the scratch buffers, so each loop streams a single array
+void sort_scatter(long begin, long end, int thread, void *ctx) {
+    cell_sort *sort = ctx;
+    int *next = sort->histogram + thread * sort->keys;
+    for(long i = begin; i < end; i++) sort_destination[i] = next[sort_key(sort, i)]++;
+    for(int f = 0; f < NUM_PARTICLE_FIELDS; f++) {
+        const uint32_t *source = *particle_fields[f];
+        uint32_t *target = sort_scratch[f];
+        for(long i = begin; i < end; i++) target[sort_destination[i]] = source[i];
+    }
+}
+
+// Parallel two-pass counting sort of the particles by cell of grid g, and
+// by species within each cell when by_species is set: per-thread
+// histograms, a prefix sum over (key, thread) so that each thread owns a
+// contiguous run of slots for every key, and a scatter of all particle
+// arrays. Threads take contiguous chunks in index order, so the sort is
+// stable and its result does not depend on the thread count. Afterwards
+// cell c is the index range [cell_start[c], cell_end[c]) and the neighbour
+// kernels stream the particle arrays directly; a species sort also fills
+// species_start.
+void sort_cells(cell_grid *g, float cell_size, int by_species) {
+    static int *histogram;
+    static long histogram_size;
+
+    size_grid(g, cell_size);
+    reserve_slots(g, particles.count);
+    int cells = g->cells_x * g->cells_y;
+    int species = by_species ? NUM_TYPES : 1;
+    long keys = (long)cells * species;
+    int threads = thread_count();
+    if(histogram_size < threads * keys) {
+        free(histogram);
+        histogram_size = threads * keys;
+        histogram = malloc(sizeof(int) * histogram_size);
+        if(!histogram) {
+            fprintf(stderr, "Cannot allocate %d cell histograms\n", threads);
+            exit(1);
+        }
+    }
+
+    // parallel_for() gives fewer threads than chunks only for tiny counts
+    if(threads > particles.count) threads = particles.count > 0 ? particles.count : 1;
+    cell_sort sort = { g, species, keys, histogram };
+    parallel_for(particles.count, sort_histogram, &sort);
+
+    int slot = 0;
+    for(long k = 0; k < keys; k++) {
+        if(k % species == 0) g->cell_start[k / species] = slot;
+        g->species_start[k] = slot;
+        for(int t = 0; t < threads; t++) {
+            int count = histogram[t * keys + k];
+            histogram[t * keys + k] = slot;
+            slot += count;
+        }
+        if(k % species == species - 1) g->cell_end[k / species] = slot;
+    }
+    g->cell_start[cells] = slot;
+    g->species_start[keys] = slot;
+
+    parallel_for(particles.count, sort_scatter, &sort);
+    for(int f = 0; f < NUM_PARTICLE_FIELDS; f++) {
+        uint32_t *swap = *particle_fields[f];
+        *particle_fields[f] = sort_scratch[f];
+        sort_scratch[f] = swap;
+    }
+
+    // The index is the identity now, kept for the indirect kernels; any
+    // incremental grid refers to the old order and has to rebuild
+    for(int i = 0; i < particles.count; i++) g->cell_particles[i] = i;
+    g->stale = 1;
+    g->rebuilds++;
+    wake_grid.stale = 1;
+}
+
+// Neighbour cells along one axis: c - 1, c, c + 1 with periodic wrap, or
+// every cell when there are fewer than 3 so none is visited twice
+static inline int neighbour_cells(int c, int cells, int *out) {
+    if(cells < 3) {
+        for(int k = 0; k < cells; k++) out[k] = k;
+        return cells;
+    }
+    out[0] = (c + cells - 1) % cells;
+    out[1] = c;
+    out[2] = (c + 1) % cells;
+    return 3;
+}
+
+// Lane-split sum over the contiguous particles [begin, end) of a sorted
+// grid, pairs beyond the cutoff removed by a select, into acc (and, unless
+// pot is NULL, their truncated potential into pot)
+static inline __attribute__((always_inline)) void cells_range(float xi, float yi, const float *coef, int begin, int end,
+                                                              float width, float height, float cutoff_squared,
+                                                              force_lanes *acc, potential_lanes *pot) {
+    float lanes[SIMD_WIDTH] = { 0 };   // See simd_sum()
+    double fixup = 0.0;
+    int k = begin;
+    for(; k + SIMD_WIDTH <= end; k += SIMD_WIDTH) {
+        float core[SIMD_WIDTH];
+        int in_core = 0;
+        for(int l = 0; l < SIMD_WIDTH; l++) {
+            float x_pos = min_image(xi - particles.x[k + l], width);
+            float y_pos = min_image(yi - particles.y[k + l], height);
+            float fx, fy, potential;
+            pair_terms(x_pos, y_pos, coef[k + l], &fx, &fy, &potential, &core[l]);
+
+            int inside = x_pos * x_pos + y_pos * y_pos < cutoff_squared;
+            lane_add(acc, l, inside ? fx : 0.0f, inside ? fy : 0.0f);
+            lanes[l] += inside ? potential : 0.0f;
+            core[l] = inside ? core[l] : 1.0f;
+            in_core |= core[l] < 1.0f;
+        }
+        if(!pot || !in_core) continue;
+        for(int l = 0; l < SIMD_WIDTH; l++) fixup += potential_fixup(pot, k + l, core[l], coef[k + l]);
+    }
+    for(int l = 0; k < end; k++, l++) {
+        float x_pos = min_image(xi - particles.x[k], width);
+        float y_pos = min_image(yi - particles.y[k], height);
+        float fx, fy, potential, core;
+        pair_terms(x_pos, y_pos, coef[k], &fx, &fy, &potential, &core);
+
+        int inside = x_pos * x_pos + y_pos * y_pos < cutoff_squared;
+        lane_add(acc, l, inside ? fx : 0.0f, inside ? fy : 0.0f);
+        if(pot && inside) {
+            lanes[l] += potential;
+            fixup += potential_fixup(pot, k, core, coef[k]);
+        }
+    }
+    if(!pot) return;
+    for(int l = 0; l < SIMD_WIDTH; l++) pot->lanes[l] += lanes[l];
+    pot->core += fixup;
+}
+
+// Cell-list kernel for a grid whose particles are sorted by cell: a row of
+// three neighbouring cells is one contiguous range unless it wraps around
+// the domain edge, so most particles sum three long ranges with the lane
+// loop of cells_range()
+static inline __attribute__((always_inline)) void cells_sorted_kernel(int i, float width, float height,
+                                                                      potential_lanes *pot) {
+    const float *coef = species_coef[particles.type[i]];
+    float xi = particles.x[i];
+    float yi = particles.y[i];
+    float cutoff_squared = params.cutoff * params.cutoff;
+    force_lanes acc = { 0 };
+
+    int cx[3] = { 0 }, cy[3] = { 0 };
+    int nx = neighbour_cells(grid.particle_cell[i] % grid.cells_x, grid.cells_x, cx);
+    int ny = neighbour_cells(grid.particle_cell[i] / grid.cells_x, grid.cells_y, cy);
+    int row_run = nx == 3 && cx[0] + 2 == cx[2];
+
+    for(int b = 0; b < ny; b++) {
+        int row = cy[b] * grid.cells_x;
+        if(row_run) {
+            cells_range(xi, yi, coef, grid.cell_start[row + cx[0]], grid.cell_end[row + cx[2]],
+                        width, height, cutoff_squared, &acc, pot);
+            continue;
+        }
+        for(int a = 0; a < nx; a++) {
+            cells_range(xi, yi, coef, grid.cell_start[row + cx[a]], grid.cell_end[row + cx[a]],
+                        width, height, cutoff_squared, &acc, pot);
+        }
+    }
+    lanes_total(&acc, &particles.fx[i], &particles.fy[i]);
+}
+
+// Cell-list kernel: same pair force as the others, restricted to particles in
+// the 3 x 3 cells around i and to separations below params.cutoff (the cells
+// are at least cutoff wide, so nothing within range is missed). Inlined into
+// its specialisations like simd_kernel().
+static inline __attribute__((always_inline)) void cells_kernel(int i, float width, float height, potential_lanes *pot) {
+    const float *coef = species_coef[particles.type[i]];
+    float xi = particles.x[i];
+    float yi = particles.y[i];
+    float cutoff_squared = params.cutoff * params.cutoff;
+    force_lanes acc = { 0 };
+
+    int cx[3], cy[3];
+    int nx = neighbour_cells(grid.particle_cell[i] % grid.cells_x, grid.cells_x, cx);
+    int ny = neighbour_cells(grid.particle_cell[i] / grid.cells_x, grid.cells_y, cy);
+
+    for(int b = 0; b < ny; b++) {
+        for(int a = 0; a < nx; a++) {
+            int c = cy[b] * grid.cells_x + cx[a];
+            for(int k = grid.cell_start[c]; k < grid.cell_end[c]; k++) {
+                int j = grid.cell_particles[k];
+                float x_pos = min_image(xi - particles.x[j], width);
+                float y_pos = min_image(yi - particles.y[j], height);
+                float fx, fy, potential, core;
+                pair_terms(x_pos, y_pos, coef[j], &fx, &fy, &potential, &core);
+
+                int inside = x_pos * x_pos + y_pos * y_pos < cutoff_squared;
+                lane_add(&acc, 0, inside ? fx : 0.0f, inside ? fy : 0.0f);
+                if(pot && inside) {
+                    pot->lanes[0] += potential;
+                    pot->core += potential_fixup(pot, j, core, coef[j]);
+                }
+            }
+        }
+    }
+    lanes_total(&acc, &particles.fx[i], &particles.fy[i]);
+}
+
+// Lane-split sum over the contiguous particles [begin, end) of a species
+// block: every pair has the same coefficient, a broadcast scalar instead of
+// a load per pair
+static inline __attribute__((always_inline)) void species_range(float xi, float yi, float coef, int begin, int end,
+                                                                float width, float height, float cutoff_squared,
+                                                                force_lanes *acc, potential_lanes *pot) {
+    float lanes[SIMD_WIDTH] = { 0 };   // See simd_sum()
+    double fixup = 0.0;
+    int k = begin;
+    for(; k + SIMD_WIDTH <= end; k += SIMD_WIDTH) {
+        float core[SIMD_WIDTH];
+        int in_core = 0;
+        for(int l = 0; l < SIMD_WIDTH; l++) {
+            float x_pos = min_image(xi - particles.x[k + l], width);
+            float y_pos = min_image(yi - particles.y[k + l], height);
+            float fx, fy, potential;
+            pair_terms(x_pos, y_pos, coef, &fx, &fy, &potential, &core[l]);
+
+            int inside = x_pos * x_pos + y_pos * y_pos < cutoff_squared;
+            lane_add(acc, l, inside ? fx : 0.0f, inside ? fy : 0.0f);
+            lanes[l] += inside ? potential : 0.0f;
+            core[l] = inside ? core[l] : 1.0f;
+            in_core |= core[l] < 1.0f;
+        }
+        if(!pot || !in_core) continue;
+        for(int l = 0; l < SIMD_WIDTH; l++) fixup += potential_fixup(pot, k + l, core[l], coef);
+    }
+    for(int l = 0; k < end; k++, l++) {
+        float x_pos = min_image(xi - particles.x[k], width);
+        float y_pos = min_image(yi - particles.y[k], height);
+        float fx, fy, potential, core;
+        pair_terms(x_pos, y_pos, coef, &fx, &fy, &potential, &core);
+
+        int inside = x_pos * x_pos + y_pos * y_pos < cutoff_squared;
+        lane_add(acc, l, inside ? fx : 0.0f, inside ? fy : 0.0f);
+        if(pot && inside) {
+            lanes[l] += potential;
+            fixup += potential_fixup(pot, k, core, coef);
+        }
+    }
+    if(!pot) return;
+    for(int l = 0; l < SIMD_WIDTH; l++) pot->lanes[l] += lanes[l];
+    pot->core += fixup;
+}
+
+// Cell-list kernel for a grid sorted by cell and species: species block by
+// species block over the 3 x 3 neighbour cells, the coefficient looked up
+// once per block and hoisted out of the pair loop
+static inline __attribute__((always_inline)) void cells_species_kernel(int i, float width, float height,
+                                                                       potential_lanes *pot) {
+    const float *row_coef = interaction[particles.type[i]];
+    float xi = particles.x[i];
+    float yi = particles.y[i];
+    float cutoff_squared = params.cutoff * params.cutoff;
+    force_lanes acc = { 0 };
+
+    int cx[3] = { 0 }, cy[3] = { 0 };
+    int nx = neighbour_cells(grid.particle_cell[i] % grid.cells_x, grid.cells_x, cx);
+    int ny = neighbour_cells(grid.particle_cell[i] / grid.cells_x, grid.cells_y, cy);
+
+    for(int b = 0; b < ny; b++) {
+        for(int a = 0; a < nx; a++) {
+            const int *block = grid.species_start + (long)(cy[b] * grid.cells_x + cx[a]) * NUM_TYPES;
+            for(int s = 0; s < NUM_TYPES; s++) {
+                species_range(xi, yi, row_coef[s], block[s], block[s + 1], width, height, cutoff_squared, &acc, pot);
+            }
+        }
+    }
+    lanes_total(&acc, &particles.fx[i], &particles.fy[i]);
+}
+
+void compute_force_cells(int i) {
+    cells_kernel(i, params.width, params.height, NULL);
+}
+
+void compute_force_cells_sorted(int i) {
+    cells_sorted_kernel(i, params.width, params.height, NULL);
+}
+
+void compute_force_cells_species(int i) {
+    cells_species_kernel(i, params.width, params.height, NULL);
+}
+
+// Specialised kernels: compute_force_simd_1000x1000() and so on, one set
+// per KERNEL_DOMAINS entry, identical to the generic ones but for the
+// constant periods
+#define DEFINE_DOMAIN_KERNELS(w, h)                                                                      \
+    void compute_force_simd_##w##x##h(int i) { simd_kernel(i, w##.0f, h##.0f, NULL); }                   \
+    void compute_force_cells_##w##x##h(int i) { cells_kernel(i, w##.0f, h##.0f, NULL); }                 \
+    void compute_force_cells_sorted_##w##x##h(int i) { cells_sorted_kernel(i, w##.0f, h##.0f, NULL); }   \
+    void compute_force_cells_species_##w##x##h(int i) { cells_species_kernel(i, w##.0f, h##.0f, NULL); }
+KERNEL_DOMAINS(DEFINE_DOMAIN_KERNELS)
+
+typedef void (*force_fn)(int i);
+
+typedef struct kernel_variant {
+    const char *name;
+    float width;
+    float height;
+    force_fn simd;
+    force_fn cells;
+    force_fn cells_sorted;
+    force_fn cells_species;
+} kernel_variant;
+
+#define DOMAIN_VARIANT(w, h) { #w "x" #h, w, h, compute_force_simd_##w##x##h, compute_force_cells_##w##x##h, \
+                               compute_force_cells_sorted_##w##x##h, compute_force_cells_species_##w##x##h },
+const kernel_variant kernel_variants[] = { KERNEL_DOMAINS(DOMAIN_VARIANT) };
+const kernel_variant generic_kernels = { "generic", 0, 0, compute_force_simd, compute_force_cells, compute_force_cells_sorted,
+                                         compute_force_cells_species };
+
+// Kernels of the current force pass, picked by select_kernels()
+const kernel_variant *kernels = &generic_kernels;
+
+// Runtime dispatch: the specialisation for the current domain size, or the
+// generic kernels when there is none (or params.specialise is off)
+void select_kernels() {
+    kernels = &generic_kernels;
+    if(!params.specialise) return;
+    for(unsigned v = 0; v < sizeof kernel_variants / sizeof *kernel_variants; v++) {
+        if(kernel_variants[v].width == params.width && kernel_variants[v].height == params.height) kernels = &kernel_variants[v];
+    }
+}
+
+// Refreshes everything the kernels derive from params, particle types and
+// (for the cell engine) positions. Called at the start of every force pass.
+void prepare_forces() {
+    inv_core_radius = 1.0f / sqrtf(params.radius_min_squared);
+    // Floor keeps 1/r^3 finite at d = 0 even without softening, so the
+    // self pair and coincident pairs still contribute 0 rather than 0 * Inf
+    softening_squared = fmaxf(params.softening * params.softening, 1e-12f);
+    // Grid first: sorting it reorders the particles the coefficients follow
+    if(params.engine == ENGINE_CELLS) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(params.cell_update == CELLS_SORTED || params.cell_update == CELLS_SPECIES) {
+            sort_cells(&grid, params.cutoff, params.cell_update == CELLS_SPECIES);
+        }
+        else refresh_cells(&grid, params.cutoff);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        cell_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+    for(int t = 0; t < NUM_TYPES; t++) {
+        for(int j = 0; j < particles.count; j++) species_coef[t][j] = interaction[t][particles.type[j]];
+        for(int j = particles.count; j < particles.padded; j++) species_coef[t][j] = 0;
+    }
+    select_kernels();
+}
+
+// True for Inf and NaN. Tests the exponent bits directly so the check
+// survives -ffast-math (which lets isfinite() fold to 1) and vectorises.
+static inline int non_finite(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    return (bits & 0x7f800000u) == 0x7f800000u;
+}
+
+// Particle closest to i (minimum image), the likely other half of the pair
+// that produced a non-finite force. -1 when i itself has no finite position.
+int sanitize_partner(int i) {
+    if(non_finite(particles.x[i]) || non_finite(particles.y[i])) return -1;
+
+    int partner = -1;
+    float best = INFINITY;
+    for(int j = 0; j < particles.count; j++) {
+        if(j == i) continue;
+        float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+        float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+        float r_squared = x_pos * x_pos + y_pos * y_pos;
+        if(r_squared < best) {
+            best = r_squared;
+            partner = j;
+        }
+    }
+    return partner;
+}
+
+// Respawns particle i at a random position at rest and logs the event
+void sanitize_particle(int i) {
+    sanitize_event *event = &sanitize_log[sanitize_count % MAX_SANITIZE_EVENTS];
+    int partner = sanitize_partner(i);
+    event->step = step_count;
+    event->particle = particles.id[i];
+    event->partner = partner >= 0 ? particles.id[partner] : -1;
+    sanitize_count++;
+
+    // The first MAX_SANITIZE_EVENTS repairs are reported, the one after says
+    // that the rest are not
+    if(sanitize_count <= MAX_SANITIZE_EVENTS) fprintf(stderr, "step %ld: particle %d non-finite (pos %f %f, vel %f %f, force %f %f), partner %d, respawned\n",
+            step_count, event->particle, particles.x[i], particles.y[i], particles.vx[i], particles.vy[i],
+            particles.fx[i], particles.fy[i], event->partner);
+    else if(sanitize_count == MAX_SANITIZE_EVENTS + 1) fprintf(stderr, "further sanitizer messages suppressed\n");
+
+    // Per-particle respawn stream, advanced by the global event count so a
+    // particle repaired twice does not land on the same spot
+    uint64_t key = rng_key(sim_seed, RNG_RESPAWN, particles.id[i]);
+    particles.x[i] = rng_float(rng_at(key, 2 * sanitize_count)) * params.width;
+    particles.y[i] = rng_float(rng_at(key, 2 * sanitize_count + 1)) * params.height;
+    particles.vx[i] = 0;
+    particles.vy[i] = 0;
+    particles.fx[i] = 0;
+    particles.fy[i] = 0;
+    particles.aggregate[i] = -1;
+    particles.quiet[i] = 0;
+}
+
+// Validation pass, run around every force pass: before it, so a bad position
+// is repaired before the cell engine bins it or it poisons every other
+// particle's force, and after it, while positions are still the ones the
+// forces were computed from (which is what lets sanitize_partner() name the
+// pair). The scan is a branch-free OR over the state arrays; only when it
+// finds something do we walk the particles again to repair them one by one.
+void validate_particles() {
+    if(!params.validate) return;
+
+    int bad = 0;
+    for(int i = 0; i < particles.count; i++) {
+        bad |= non_finite(particles.x[i]) | non_finite(particles.y[i])
+             | non_finite(particles.vx[i]) | non_finite(particles.vy[i])
+             | non_finite(particles.fx[i]) | non_finite(particles.fy[i]);
+    }
+    if(!bad) return;
+
+    for(int i = 0; i < particles.count; i++) {
+        if(non_finite(particles.x[i]) || non_finite(particles.y[i])
+           || non_finite(particles.vx[i]) || non_finite(particles.vy[i])
+           || non_finite(particles.fx[i]) || non_finite(particles.fy[i])) {
+            sanitize_particle(i);
+        }
+    }
+}
+
+// Level of detail state: the aggregates, and the compacted force sources of
+// a pass (free particles first, then one pseudo-particle per aggregate)
+aggregate *aggregates;
+int aggregate_count;
+int *lod_free;                  // Indices of the free particles
+int lod_free_count;
+float *lod_x;
+float *lod_y;
+float *lod_coef[NUM_TYPES];     // lod_coef[t][s]: coefficient of source s on a particle of type t
+int lod_padded;                 // Source count rounded up to SIMD_WIDTH
+int *lod_seen;                  // Size of the cluster led by particle i at the previous search, 0 if none
+
+// Union-find root of i with path halving
+static inline int find_root(int *parent, int i) {
+    while(parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Distance an aggregate of the given radius needs to everything else: far
+// enough for its far field to be accurate, and never within linking range
+// of one of its members
+static inline float lod_reach(float radius) {
+    return fmaxf(LOD_SEPARATION * radius, radius + LOD_LINK);
+}
+
+// Distance from (x, y) to the nearest free particle outside cluster root (of
+// parent; root -1 for an aggregate's own check) and to the nearest
+// aggregate other than skip
+float lod_clearance(float x, float y, int *parent, int root, int skip) {
+    float nearest = INFINITY;
+    for(int f = 0; f < lod_free_count; f++) {
+        int i = lod_free[f];
+        if(root >= 0 && find_root(parent, i) == root) continue;
+        float dx = min_image(particles.x[i] - x, params.width);
+        float dy = min_image(particles.y[i] - y, params.height);
+        nearest = fminf(nearest, sqrtf(dx * dx + dy * dy));
+    }
+    for(int a = 0; a < aggregate_count; a++) {
+        if(a == skip) continue;
+        float dx = min_image(aggregates[a].x - x, params.width);
+        float dy = min_image(aggregates[a].y - y, params.height);
+        nearest = fminf(nearest, sqrtf(dx * dx + dy * dy));
+    }
+    return nearest;
+}
+
+// Recomputes centre, radius and species counts of every aggregate from its
+// members (thermal noise and repairs move members individually), expands the
+// disturbed ones and renumbers the rest
+void lod_refresh() {
+    for(int a = 0; a < aggregate_count; a++) {
+        aggregate *g = &aggregates[a];
+        g->members = 0;
+        g->radius = 0;
+        g->expand = 0;
+        for(int t = 0; t < NUM_TYPES; t++) g->count[t] = 0;
+        g->fx = g->fy = 0;   // Mean member offset from the old centre
+    }
+    for(int i = 0; i < particles.count; i++) {
+        if(particles.aggregate[i] < 0) continue;
+        aggregate *g = &aggregates[particles.aggregate[i]];
+        g->members++;
+        g->count[particles.type[i]]++;
+        g->fx += min_image(particles.x[i] - g->x, params.width);
+        g->fy += min_image(particles.y[i] - g->y, params.height);
+    }
+    for(int a = 0; a < aggregate_count; a++) {
+        aggregate *g = &aggregates[a];
+        if(g->members == 0) continue;
+        g->x = wrap_coordinate(g->x + g->fx / g->members, params.width);
+        g->y = wrap_coordinate(g->y + g->fy / g->members, params.height);
+    }
+    for(int i = 0; i < particles.count; i++) {
+        if(particles.aggregate[i] < 0) continue;
+        aggregate *g = &aggregates[particles.aggregate[i]];
+        float dx = min_image(particles.x[i] - g->x, params.width);
+        float dy = min_image(particles.y[i] - g->y, params.height);
+        g->radius = fmaxf(g->radius, sqrtf(dx * dx + dy * dy));
+    }
+
+    lod_free_count = 0;
+    for(int i = 0; i < particles.count; i++) if(particles.aggregate[i] < 0) lod_free[lod_free_count++] = i;
+
+    // Disturbed: spread out, lost members, or something came too close
+    int *renumber = malloc(sizeof(int) * (aggregate_count + 1));
+    if(!renumber) {
+        fprintf(stderr, "Cannot allocate %d aggregates\n", aggregate_count);
+        exit(1);
+    }
+    int kept = 0;
+    for(int a = 0; a < aggregate_count; a++) {
+        aggregate *g = &aggregates[a];
+        g->expand = g->members < LOD_MIN_MEMBERS || g->radius > LOD_RADIUS
+                 || lod_clearance(g->x, g->y, NULL, -1, a) < lod_reach(g->radius);
+    }
+    for(int a = 0; a < aggregate_count; a++) {
+        renumber[a] = aggregates[a].expand ? -1 : kept;
+        if(!aggregates[a].expand) aggregates[kept++] = aggregates[a];
+    }
+    for(int i = 0; i < particles.count; i++) {
+        if(particles.aggregate[i] < 0) continue;
+        particles.aggregate[i] = renumber[particles.aggregate[i]];
+        if(particles.aggregate[i] < 0) lod_free[lod_free_count++] = i;
+    }
+    aggregate_count = kept;
+    free(renumber);
+}
+
+// Freezes the free particles of cluster root into a new aggregate, with the
+// mean force the members exert on each other as its drift
+void lod_freeze(int *parent, int root, float x, float y, float radius) {
+    aggregate *g = &aggregates[aggregate_count];
+    int id = aggregate_count++;
+    g->x = x;
+    g->y = y;
+    g->radius = radius;
+    g->members = 0;
+    for(int t = 0; t < NUM_TYPES; t++) g->count[t] = 0;
+
+    double drift_x = 0, drift_y = 0;
+    for(int f = 0; f < lod_free_count; f++) {
+        int i = lod_free[f];
+        if(find_root(parent, i) != root) continue;
+        for(int e = 0; e < lod_free_count; e++) {
+            int j = lod_free[e];
+            if(j == i || find_root(parent, j) != root) continue;
+            float fx, fy;
+            pair_force(min_image(particles.x[i] - particles.x[j], params.width),
+                       min_image(particles.y[i] - particles.y[j], params.height),
+                       interaction[particles.type[i]][particles.type[j]], &fx, &fy);
+            drift_x += fx;
+            drift_y += fy;
+        }
+        particles.aggregate[i] = id;
+        g->members++;
+        g->count[particles.type[i]]++;
+    }
+    g->drift_x = drift_x / g->members;
+    g->drift_y = drift_y / g->members;
+}
+
+// Search for new aggregates among the free particles: link particles closer
+// than LOD_LINK (union-find over a grid of LOD_LINK cells), then freeze every
+// cluster that is big, tight, stable and isolated
+void lod_form() {
+    int cells_x = (int)(params.width / LOD_LINK);
+    int cells_y = (int)(params.height / LOD_LINK);
+    if(cells_x < 1) cells_x = 1;
+    if(cells_y < 1) cells_y = 1;
+    int cells = cells_x * cells_y;
+    int n = lod_free_count;
+
+    // Counting sort of the free particles by cell, as in build_cells()
+    int *start = calloc(cells + 1, sizeof(int));
+    int *cell_of = malloc(sizeof(int) * (n + 1));
+    int *order = malloc(sizeof(int) * (n + 1));
+    int *parent = malloc(sizeof(int) * particles.count);
+    if(!start || !cell_of || !order || !parent) {
+        fprintf(stderr, "Cannot allocate %d x %d link grid\n", cells_x, cells_y);
+        exit(1);
+    }
+    for(int f = 0; f < n; f++) {
+        int i = lod_free[f];
+        cell_of[f] = cell_coordinate(particles.y[i], params.height, cells_y) * cells_x
+                   + cell_coordinate(particles.x[i], params.width, cells_x);
+        start[cell_of[f] + 1]++;
+    }
+    for(int c = 0; c < cells; c++) start[c + 1] += start[c];
+    for(int f = 0; f < n; f++) order[start[cell_of[f]]++] = lod_free[f];
+    for(int c = cells; c > 0; c--) start[c] = start[c - 1];
+    start[0] = 0;
+
+    for(int i = 0; i < particles.count; i++) parent[i] = i;
+    for(int f = 0; f < n; f++) {
+        int i = lod_free[f];
+        int cx[3], cy[3];
+        int nx = neighbour_cells(cell_of[f] % cells_x, cells_x, cx);
+        int ny = neighbour_cells(cell_of[f] / cells_x, cells_y, cy);
+        for(int b = 0; b < ny; b++) {
+            for(int a = 0; a < nx; a++) {
+                int c = cy[b] * cells_x + cx[a];
+                for(int k = start[c]; k < start[c + 1]; k++) {
+                    int j = order[k];
+                    if(j <= i) continue;
+                    float dx = min_image(particles.x[i] - particles.x[j], params.width);
+                    float dy = min_image(particles.y[i] - particles.y[j], params.height);
+                    if(dx * dx + dy * dy >= LOD_LINK * LOD_LINK) continue;
+                    int ri = find_root(parent, i);
+                    int rj = find_root(parent, j);
+                    if(ri != rj) parent[ri < rj ? rj : ri] = ri < rj ? ri : rj;
+                }
+            }
+        }
+    }
+
+    // Per cluster (roots are the smallest member index, so a cluster keeps
+    // its root while its membership holds): size, centre as the mean offset
+    // from the root, then radius
+    float *offset = calloc(2 * (size_t)particles.count, sizeof(float));
+    float *radius = calloc(particles.count, sizeof(float));
+    int *size = calloc(particles.count, sizeof(int));
+    if(!offset || !radius || !size) {
+        fprintf(stderr, "Cannot allocate cluster statistics\n");
+        exit(1);
+    }
+    for(int f = 0; f < n; f++) {
+        int i = lod_free[f];
+        int r = find_root(parent, i);
+        size[r]++;
+        offset[2 * r] += min_image(particles.x[i] - particles.x[r], params.width);
+        offset[2 * r + 1] += min_image(particles.y[i] - particles.y[r], params.height);
+    }
+    for(int f = 0; f < n; f++) {
+        int r = lod_free[f];
+        if(parent[r] != r) continue;
+        offset[2 * r] = wrap_coordinate(particles.x[r] + offset[2 * r] / size[r], params.width);
+        offset[2 * r + 1] = wrap_coordinate(particles.y[r] + offset[2 * r + 1] / size[r], params.height);
+    }
+    for(int f = 0; f < n; f++) {
+        int i = lod_free[f];
+        int r = find_root(parent, i);
+        float dx = min_image(particles.x[i] - offset[2 * r], params.width);
+        float dy = min_image(particles.y[i] - offset[2 * r + 1], params.height);
+        radius[r] = fmaxf(radius[r], sqrtf(dx * dx + dy * dy));
+    }
+
+    // Stable: the same root led a cluster of the same size one search ago.
+    // Particle-life clusters churn inside, so this asks for the cluster as
+    // a whole to persist rather than for its members to sit still.
+    for(int f = 0; f < n; f++) {
+        int r = lod_free[f];
+        int stable = parent[r] == r && lod_seen[r] == size[r];
+        lod_seen[r] = parent[r] == r ? size[r] : 0;
+        if(!stable || size[r] < LOD_MIN_MEMBERS || radius[r] > LOD_RADIUS) continue;
+        if(lod_clearance(offset[2 * r], offset[2 * r + 1], parent, r, -1) < lod_reach(radius[r])) continue;
+        lod_freeze(parent, r, offset[2 * r], offset[2 * r + 1], radius[r]);
+    }
+
+    // The frozen particles are no longer free
+    lod_free_count = 0;
+    for(int i = 0; i < particles.count; i++) if(particles.aggregate[i] < 0) lod_free[lod_free_count++] = i;
+
+    free(start);
+    free(cell_of);
+    free(order);
+    free(parent);
+    free(offset);
+    free(radius);
+    free(size);
+}
+
+// Source arrays of the pass: every free particle with its own coefficient,
+// and every aggregate as one source at its centre whose coefficient on a
+// type t particle is the sum over its members, sum_s count[s] interaction[t][s]
+void lod_sources() {
+    int s = 0;
+    for(int f = 0; f < lod_free_count; f++, s++) {
+        int i = lod_free[f];
+        lod_x[s] = particles.x[i];
+        lod_y[s] = particles.y[i];
+        for(int t = 0; t < NUM_TYPES; t++) lod_coef[t][s] = interaction[t][particles.type[i]];
+    }
+    for(int a = 0; a < aggregate_count; a++, s++) {
+        lod_x[s] = aggregates[a].x;
+        lod_y[s] = aggregates[a].y;
+        for(int t = 0; t < NUM_TYPES; t++) {
+            float coef = 0;
+            for(int u = 0; u < NUM_TYPES; u++) coef += aggregates[a].count[u] * interaction[t][u];
+            lod_coef[t][s] = coef;
+        }
+    }
+    lod_padded = (s + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    for(; s < lod_padded; s++) {
+        lod_x[s] = lod_y[s] = 0;
+        for(int t = 0; t < NUM_TYPES; t++) lod_coef[t][s] = 0;
+    }
+}
+
+// Forces on targets [begin, end) of a level of detail pass: free particles
+// get the exact near field of the other free particles plus the far field
+// of the aggregates; aggregate a gets, per member, the sum over its species
+// of the force on a particle of that species at its centre, plus its drift.
+// A source sitting on the target (the particle or aggregate itself) is at
+// distance 0 and contributes zero.
+void lod_force_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    (void)ctx;
+    for(long n = begin; n < end; n++) {
+        if(n < lod_free_count) {
+            int i = lod_free[n];
+            simd_sum(particles.x[i], particles.y[i], lod_x, lod_y, lod_coef[particles.type[i]], lod_padded,
+                     params.width, params.height, &particles.fx[i], &particles.fy[i], NULL);
+            continue;
+        }
+        aggregate *g = &aggregates[n - lod_free_count];
+        float fx = 0, fy = 0;
+        for(int t = 0; t < NUM_TYPES; t++) {
+            if(!g->count[t]) continue;
+            float sx, sy;
+            simd_sum(g->x, g->y, lod_x, lod_y, lod_coef[t], lod_padded, params.width, params.height, &sx, &sy, NULL);
+            fx += g->count[t] * sx;
+            fy += g->count[t] * sy;
+        }
+        g->fx = fx / g->members + g->drift_x;
+        g->fy = fy / g->members + g->drift_y;
+    }
+}
+
+// Level of detail force pass. Every aggregate is at least lod_reach() of its
+// radius away from everything else, so it only ever acts through the far field; its
+// members then all get the aggregate's force, which the integrator turns
+// into one rigid translation.
+void lod_forces() {
+    lod_refresh();
+    if(step_count % LOD_INTERVAL == 0) lod_form();
+    lod_sources();
+
+    long targets = lod_free_count + aggregate_count;
+    if(params.engine == ENGINE_THREADED) parallel_for(targets, lod_force_range, NULL);
+    else lod_force_range(0, targets, 0, NULL);
+
+    for(int i = 0; i < particles.count; i++) {
+        if(particles.aggregate[i] < 0) continue;
+        particles.fx[i] = aggregates[particles.aggregate[i]].fx;
+        particles.fy[i] = aggregates[particles.aggregate[i]].fy;
+    }
+}
+
+// Force on particle i with the selected engine
+void compute_force(int i) {
+    if(params.engine == ENGINE_SCALAR) compute_force_scalar(i);
+    else if(params.engine == ENGINE_CELLS) {
+        if(params.cell_update == CELLS_SORTED) kernels->cells_sorted(i);
+        else if(params.cell_update == CELLS_SPECIES) kernels->cells_species(i);
+        else kernels->cells(i);
+    }
+    else kernels->simd(i);
+}
+
+// True for a sleeping particle whose turn it is not this step: it keeps
+// its position and gets no force. Sleepers take turns staggered by index,
+// so every step updates about 1 / SLEEP_INTERVAL of them.
+static inline int dormant(long i) {
+    return params.sleep && particles.quiet[i] >= SLEEP_STEPS && (step_count + particles.id[i]) % SLEEP_INTERVAL != 0;
+}
+
+// Observables of the step in progress, gathered by the integrators and the
+// force pass while they touch each particle anyway and written out by
+// diagnostics_emit() every params.diagnostics steps
+typedef struct diagnostics {
+    int active;                      // Set during the steps that produce a record
+    double displacement;             // Total distance moved by all particles during the step
+    double speed[NUM_TYPES];         // Sum of the speeds per species
+    int count[NUM_TYPES];
+    double potential[MAX_THREADS];   // Per-thread partial sums of the pair potential
+    int potential_done;              // Set when the force pass has filled potential
+    int cells_x;                     // Grid of DIAGNOSTICS_LINK cells for the cluster estimate
+    int cells_y;
+    unsigned char *occupied;         // Cells holding at least one particle
+    int *parent;                     // Union-find over the cells
+    FILE *out;
+    int csv;
+} diagnostics;
+
+diagnostics diag;
+
+// Pair potential of particle i with everything it interacts with: the
+// particles within params.cutoff for the cell engine (truncated, not
+// shifted), all of them otherwise. The self pair is left out (its softened
+// potential is not zero).
+double particle_potential(int i) {
+    float xi = particles.x[i];
+    float yi = particles.y[i];
+    double sum = 0;
+    if(params.engine != ENGINE_CELLS) {
+        // Outer form coef * COEFFICIENT / s of every pair in vector lanes;
+        // the rare blocks with a pair inside the core radius (i itself
+        // included) are redone pair by pair with the exact potential
+        const float *coef_j = species_coef[particles.type[i]];
+        float core_squared = 1.0f / (inv_core_radius * inv_core_radius);
+        float lanes[SIMD_WIDTH] = { 0 };
+        for(int j = 0; j < particles.padded; j += SIMD_WIDTH) {
+            float outer[SIMD_WIDTH];
+            int core = 0;
+            for(int k = 0; k < SIMD_WIDTH; k++) {
+                float x_pos = min_image(xi - particles.x[j + k], params.width);
+                float y_pos = min_image(yi - particles.y[j + k], params.height);
+                float s_squared = x_pos * x_pos + y_pos * y_pos + softening_squared;
+                outer[k] = coef_j[j + k] * (float)(COEFFICIENT) / sqrtf(s_squared);
+                core |= s_squared < core_squared;
+            }
+            if(!core) {
+                for(int k = 0; k < SIMD_WIDTH; k++) lanes[k] += outer[k];
+                continue;
+            }
+            for(int k = 0; k < SIMD_WIDTH; k++) {
+                float x_pos = min_image(xi - particles.x[j + k], params.width);
+                float y_pos = min_image(yi - particles.y[j + k], params.height);
+                lanes[k] += j + k == i || j + k >= particles.count ? 0.0f : pair_potential(x_pos, y_pos, coef_j[j + k]);
+            }
+        }
+        for(int k = 0; k < SIMD_WIDTH; k++) sum += lanes[k];
+        return sum;
+    }
+
+    float cutoff_squared = params.cutoff * params.cutoff;
+    int cx[3] = { 0 }, cy[3] = { 0 };
+    int nx = neighbour_cells(grid.particle_cell[i] % grid.cells_x, grid.cells_x, cx);
+    int ny = neighbour_cells(grid.particle_cell[i] / grid.cells_x, grid.cells_y, cy);
+    for(int b = 0; b < ny; b++) {
+        for(int a = 0; a < nx; a++) {
+            int c = cy[b] * grid.cells_x + cx[a];
+            for(int k = grid.cell_start[c]; k < grid.cell_end[c]; k++) {
+                int j = grid.cell_particles[k];
+                float x_pos = min_image(xi - particles.x[j], params.width);
+                float y_pos = min_image(yi - particles.y[j], params.height);
+                if(j == i || x_pos * x_pos + y_pos * y_pos >= cutoff_squared) continue;
+                sum += pair_potential(x_pos, y_pos, interaction[particles.type[i]][particles.type[j]]);
+            }
+        }
+    }
+    return sum;
+}
+
+// Force kernels that also return the pair potential of particle i, the
+// same sum as particle_potential() gathered from the distances the force
+// already computes. force_range() runs them instead of compute_force() on
+// record steps. Generic periods only: those steps are rare, and the
+// specialisation is worth a few percent.
+typedef double (*potential_fn)(int i);
+
+// The scalar engine is the plain reference, so it keeps the two passes
+double compute_potential_scalar(int i) {
+    compute_force_scalar(i);
+    return particle_potential(i);
+}
+
+double compute_potential_simd(int i) {
+    potential_lanes pot = { .self = i, .count = particles.count };
+    simd_kernel(i, params.width, params.height, &pot);
+    return potential_total(&pot, interaction[particles.type[i]][particles.type[i]]);
+}
+
+double compute_potential_cells(int i) {
+    potential_lanes pot = { .self = i, .count = particles.count };
+    cells_kernel(i, params.width, params.height, &pot);
+    return potential_total(&pot, interaction[particles.type[i]][particles.type[i]]);
+}
+
+double compute_potential_cells_sorted(int i) {
+    potential_lanes pot = { .self = i, .count = particles.count };
+    cells_sorted_kernel(i, params.width, params.height, &pot);
+    return potential_total(&pot, interaction[particles.type[i]][particles.type[i]]);
+}
+
+double compute_potential_cells_species(int i) {
+    potential_lanes pot = { .self = i, .count = particles.count };
+    cells_species_kernel(i, params.width, params.height, &pot);
+    return potential_total(&pot, interaction[particles.type[i]][particles.type[i]]);
+}
+
+// Force and potential kernel of the selected engine, see compute_force()
+potential_fn potential_kernel() {
+    if(params.engine == ENGINE_SCALAR) return compute_potential_scalar;
+    if(params.engine == ENGINE_CELLS) {
+        if(params.cell_update == CELLS_SORTED) return compute_potential_cells_sorted;
+        if(params.cell_update == CELLS_SPECIES) return compute_potential_cells_species;
+        return compute_potential_cells;
+    }
+    return compute_potential_simd;
+}
+
+// One thread's share of a potential pass, for steps whose force pass did
+// not fill it in (block steps and level of detail)
+void potential_range(long begin, long end, int thread, void *ctx) {
+    (void)ctx;
+    double sum = 0;
+    for(long i = begin; i < end; i++) sum += particle_potential(i);
+    diag.potential[thread] += sum;
+}
+
+// Distance moved by one particle during the step
+static inline void diagnose_move(float dx, float dy) {
+    diag.displacement += sqrtf(dx * dx + dy * dy);
+}
+
+// Speed of particle i at the end of the step, and its cell for the cluster
+// estimate (the position may not be wrapped yet)
+static inline void diagnose_particle(int i, float speed) {
+    diag.speed[particles.type[i]] += speed;
+    diag.count[particles.type[i]]++;
+    int cx = cell_coordinate(wrap_coordinate(particles.x[i], params.width), params.width, diag.cells_x);
+    int cy = cell_coordinate(wrap_coordinate(particles.y[i], params.height), params.height, diag.cells_y);
+    diag.occupied[cy * diag.cells_x + cx] = 1;
+}
+
+// Clears the sums before a step that produces a record, resizing the
+// occupancy grid when the domain changed
+void diagnostics_begin() {
+    int cells_x = (int)(params.width / DIAGNOSTICS_LINK);
+    int cells_y = (int)(params.height / DIAGNOSTICS_LINK);
+    if(cells_x < 1) cells_x = 1;
+    if(cells_y < 1) cells_y = 1;
+    if(cells_x != diag.cells_x || cells_y != diag.cells_y || !diag.occupied) {
+        free(diag.occupied);
+        free(diag.parent);
+        diag.cells_x = cells_x;
+        diag.cells_y = cells_y;
+        diag.occupied = malloc((long)cells_x * cells_y);
+        diag.parent = malloc(sizeof(int) * cells_x * cells_y);
+        if(!diag.occupied || !diag.parent) {
+            fprintf(stderr, "Cannot allocate %d x %d diagnostics grid\n", cells_x, cells_y);
+            exit(1);
+        }
+    }
+    memset(diag.occupied, 0, (long)cells_x * cells_y);
+    diag.displacement = 0;
+    for(int t = 0; t < NUM_TYPES; t++) {
+        diag.speed[t] = 0;
+        diag.count[t] = 0;
+    }
+    for(int t = 0; t < MAX_THREADS; t++) diag.potential[t] = 0;
+    diag.potential_done = 0;
+    diag.active = 1;
+}
+
+// Cluster estimate: connected groups of occupied DIAGNOSTICS_LINK cells,
+// neighbours including diagonals and across the periodic edges. Cheap and
+// grid-resolution limited: clusters closer than about two cells merge.
+int cluster_estimate() {
+    int cells_x = diag.cells_x;
+    int cells_y = diag.cells_y;
+    int cells = cells_x * cells_y;
+    for(int c = 0; c < cells; c++) diag.parent[c] = c;
+    for(int c = 0; c < cells; c++) {
+        if(!diag.occupied[c]) continue;
+        int x = c % cells_x, y = c / cells_x;
+        // Right, and the three cells below: every neighbour pair once
+        const int offsets[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+        for(int o = 0; o < 4; o++) {
+            int n = (y + offsets[o][1]) % cells_y * cells_x + (x + offsets[o][0] + cells_x) % cells_x;
+            if(!diag.occupied[n]) continue;
+            int a = find_root(diag.parent, c), b = find_root(diag.parent, n);
+            if(a != b) diag.parent[a > b ? a : b] = a > b ? b : a;
+        }
+    }
+    int clusters = 0;
+    for(int c = 0; c < cells; c++) clusters += diag.occupied[c] && diag.parent[c] == c;
+    return clusters;
+}
+
+// Opens a record stream: the file at path, or stdout when path is NULL.
+// Sets *csv when the name ends in ".csv" (records are ndjson otherwise).
+// Returns NULL when the file cannot be created.
+FILE *open_stream(const char *path, int *csv) {
+    size_t length = path ? strlen(path) : 0;
+    *csv = length >= 4 && !strcmp(path + length - 4, ".csv");
+    if(!path) return stdout;
+    FILE *out = fopen(path, "w");
+    if(!out) fprintf(stderr, "Cannot create %s\n", path);
+    return out;
+}
+
+// Opens the diagnostics stream and writes the CSV header. Returns 1 when
+// the file cannot be created.
+int diagnostics_open() {
+    diag.out = open_stream(params.diagnostics_path, &diag.csv);
+    if(!diag.out) return 1;
+    if(diag.csv) {
+        fprintf(diag.out, "step,time,displacement");
+        for(int t = 0; t < NUM_TYPES; t++) fprintf(diag.out, ",speed_%d", t);
+        fprintf(diag.out, ",clusters,potential,sleeping\n");
+    }
+    return 0;
+}
+
+// Ends the record of the step just taken and returns its potential: half
+// the sum over the particles, each pair counted once (the species matrix is
+// not symmetric, so it is the mean of the two directions)
+double diagnostics_end() {
+    diag.active = 0;
+    if(!diag.potential_done) parallel_for(particles.count, potential_range, NULL);
+    double potential = 0;
+    for(int t = 0; t < MAX_THREADS; t++) potential += diag.potential[t];
+    return 0.5 * potential;
+}
+
+// Finishes the record of the step just taken and writes it as one CSV row
+// or one JSON object per line
+void diagnostics_emit() {
+    double potential = diagnostics_end();
+    int clusters = cluster_estimate();
+
+    if(diag.csv) {
+        fprintf(diag.out, "%ld,%g,%g", step_count, sim_time, diag.displacement);
+        for(int t = 0; t < NUM_TYPES; t++) fprintf(diag.out, ",%g", diag.count[t] ? diag.speed[t] / diag.count[t] : 0);
+        fprintf(diag.out, ",%d,%g,%g\n", clusters, potential, sleeping_fraction);
+    }
+    else {
+        fprintf(diag.out, "{\"step\":%ld,\"time\":%g,\"displacement\":%g,\"speed\":[", step_count, sim_time, diag.displacement);
+        for(int t = 0; t < NUM_TYPES; t++) {
+            fprintf(diag.out, "%s%g", t ? "," : "", diag.count[t] ? diag.speed[t] / diag.count[t] : 0);
+        }
+        fprintf(diag.out, "],\"clusters\":%d,\"potential\":%g,\"sleeping\":%g}\n", clusters, potential, sleeping_fraction);
+    }
+    fflush(diag.out);
+}
+
+// One thread's share of a force pass, plus the pair potential of each
+// particle on the steps that produce a diagnostics record, summed by the
+// force kernel itself (a dormant particle gets no force pass, so its
+// potential takes the separate one)
+void force_range(long begin, long end, int thread, void *ctx) {
+    (void)ctx;
+    potential_fn with_potential = diag.active ? potential_kernel() : NULL;
+    double potential = 0;
+    for(long i = begin; i < end; i++) {
+        if(dormant(i)) {
+            particles.fx[i] = particles.fy[i] = 0;
+            if(with_potential) potential += particle_potential(i);
+            continue;
+        }
+        if(with_potential) potential += with_potential(i);
+        else compute_force(i);
+    }
+    diag.potential[thread] += potential;
+}
+
+// Force pass over every particle. Each force only reads positions, so the
+// threaded engines give bit-identical results to their serial kernel. The
+// state is repaired before prepare_forces() bins it: a non-finite position
+// has no cell.
+void compute_forces() {
+    validate_particles();
+    prepare_forces();
+    if(params.lod) lod_forces();
+    else if(params.engine == ENGINE_THREADED || params.engine == ENGINE_CELLS) parallel_for(particles.count, force_range, NULL);
+    else force_range(0, particles.count, 0, NULL);
+    diag.potential_done = diag.active && !params.lod;
+    validate_particles();
+}
+
+// Periodic wrap of every position, applied by each integrator right after
+// its drift so every engine sees coordinates in [0, params.width) x [0, params.height).
+// Like validate_particles(), a branch-free OR over the positions looks for
+// the rare far-out values first, so the wrap itself stays a vector loop and
+// only a step that has some pays for the scalar fmodf() pass.
+void wrap_positions() {
+    float width = params.width;
+    float height = params.height;
+    int far = 0;
+    for(int i = 0; i < particles.count; i++) {
+        far |= (fabsf(particles.x[i]) >= WRAP_PERIODS * width) | (fabsf(particles.y[i]) >= WRAP_PERIODS * height);
+    }
+    if(far) {
+        for(int i = 0; i < particles.count; i++) {
+            particles.x[i] = wrap_coordinate_exact(particles.x[i], width);
+            particles.y[i] = wrap_coordinate_exact(particles.y[i], height);
+        }
+        return;
+    }
+    for(int i = 0; i < particles.count; i++) {
+        particles.x[i] = wrap_coordinate(particles.x[i], width);
+        particles.y[i] = wrap_coordinate(particles.y[i], height);
+    }
+}
+
+// Largest step particle i may take without moving more than max_displacement:
+// |v| dt (or |f| dt when overdamped) and the 1/2 |a| dt^2 of an inertial
+// particle starting from rest must both stay below the limit. Not clamped.
+float particle_dt(int i) {
+    float dt = INFINITY;
+    float f = sqrtf(particles.fx[i] * particles.fx[i] + particles.fy[i] * particles.fy[i]);
+
+    if(params.inertial) {
+        float v = sqrtf(particles.vx[i] * particles.vx[i] + particles.vy[i] * particles.vy[i]);
+        if(v > 0) dt = params.max_displacement / v;
+        if(f > 0) dt = fminf(dt, sqrtf(2.0f * params.max_displacement / f));
+    }
+    else if(f > 0) dt = params.max_displacement / f;
+
+    return dt;
+}
+
+// Step for the next global update: params.dt, or the most restrictive
+// particle_dt clamped to [dt_min, dt_max] when adaptive stepping is on
+float choose_dt() {
+    if(!params.adaptive) return params.dt;
+
+    float dt = params.dt_max;
+    for(int i = 0; i < particles.count; i++) dt = fminf(dt, particle_dt(i));
+    return fmaxf(dt, params.dt_min);
+}
+
+// Fresh forces for the particles whose block step ends at tick *ctx, with
+// the kernel of the selected engine
+void block_force_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    int tick = *(const int *)ctx;
+    int ticks = 1 << (params.block_levels - 1);
+    for(long i = begin; i < end; i++) {
+        if((tick + 1) % (ticks >> particles.level[i])) continue;
+        compute_force(i);
+    }
+}
+
+// Finest level whose step dt_max / 2^level fits particle_dt(i)
+int particle_level(int i) {
+    float dt = particle_dt(i);
+    int level = 0;
+    while(level < params.block_levels - 1 && params.dt_max / (1 << level) > dt) level++;
+    return level;
+}
+
+// Thermal noise for one axis of particle i in noise pass pass: a unit normal
+// drawn straight from the counter-based stream, so it is computed inside the
+// integration loops without any stored random state
+static inline float thermal_noise(long i, int axis, uint64_t pass) {
+    return rng_normal(rng_at(noise_key, (pass * particles.padded + particles.id[i]) * 2 + axis));
+}
+
+// Activity update after a step: a particle counts one more quiet step when
+// it moved less than SLEEP_THRESHOLD and so did everyone within SLEEP_WAKE
+// (found through the cell grid, and only looked for around the particles
+// that are quiet themselves, stopping at the first moving one). Sleeping
+// therefore needs quiet surroundings, and a moving neighbour wakes a
+// sleeper at once.
+void update_activity() {
+    refresh_cells(&wake_grid, SLEEP_WAKE);
+    int asleep = 0;
+
+    for(int i = 0; i < particles.count; i++) {
+        int quiet = particles.moved[i] < SLEEP_THRESHOLD;
+        int cx[3], cy[3];
+        int nx = quiet ? neighbour_cells(wake_grid.particle_cell[i] % wake_grid.cells_x, wake_grid.cells_x, cx) : 0;
+        int ny = quiet ? neighbour_cells(wake_grid.particle_cell[i] / wake_grid.cells_x, wake_grid.cells_y, cy) : 0;
+        for(int b = 0; b < ny && quiet; b++) {
+            for(int a = 0; a < nx && quiet; a++) {
+                int c = cy[b] * wake_grid.cells_x + cx[a];
+                for(int k = wake_grid.cell_start[c]; k < wake_grid.cell_end[c] && quiet; k++) {
+                    int j = wake_grid.cell_particles[k];
+                    float dx = min_image(particles.x[i] - particles.x[j], params.width);
+                    float dy = min_image(particles.y[i] - particles.y[j], params.height);
+                    quiet = particles.moved[j] < SLEEP_THRESHOLD || dx * dx + dy * dy >= SLEEP_WAKE * SLEEP_WAKE;
+                }
+            }
+        }
+        particles.quiet[i] = quiet ? particles.quiet[i] + 1 : 0;
+        asleep += particles.quiet[i] >= SLEEP_STEPS;
+    }
+    sleeping_fraction = particles.count ? (float)asleep / particles.count : 0;
+}
+
+// Overdamped drift with activity tracking. Awake particles move as in
+// step_overdamped(); a sleeper stays put until its turn, then catches up
+// with a step of SLEEP_INTERVAL * dt. moved records distance per step.
+void step_sleeping(float dt, float noise, int thermal, uint64_t pass) {
+    for(int i = 0; i < particles.count; i++) {
+        if(dormant(i)) {
+            particles.moved[i] = 0;
+            if(diag.active) diagnose_particle(i, 0);
+            continue;
+        }
+        int steps = particles.quiet[i] >= SLEEP_STEPS ? SLEEP_INTERVAL : 1;
+        float dx = particles.fx[i] * dt * steps;
+        float dy = particles.fy[i] * dt * steps;
+        if(thermal) {
+            dx += noise * sqrtf(steps) * thermal_noise(i, 0, pass);
+            dy += noise * sqrtf(steps) * thermal_noise(i, 1, pass);
+        }
+        particles.x[i] += dx;
+        particles.y[i] += dy;
+        particles.moved[i] = sqrtf(dx * dx + dy * dy) / steps;
+        if(diag.active) {
+            diagnose_move(dx, dy);
+            diagnose_particle(i, particles.moved[i] / dt);
+        }
+    }
+    wrap_positions();
+    update_activity();
+}
+
+// Overdamped step: the force is a velocity, so positions move by force * dt.
+// With dt = 1 this is the original "force as displacement" update. At a
+// nonzero temperature T the step is Euler-Maruyama Brownian dynamics and
+// adds sqrt(2 T dt) times a unit normal per axis.
+void step_overdamped() {
+    compute_forces();
+    float dt = choose_dt();
+    last_dt = dt;
+    sim_time += dt;
+
+    int thermal = params.temperature > 0;
+    float noise = sqrtf(2.0f * params.temperature * dt);
+    uint64_t pass = noise_pass;
+    noise_pass += thermal;
+    if(params.sleep) {
+        step_sleeping(dt, noise, thermal, pass);
+        return;
+    }
+    for(int i = 0; i < particles.count; i++) {
+        float x = particles.x[i];
+        float y = particles.y[i];
+        particles.x[i] += particles.fx[i] * dt;
+        particles.y[i] += particles.fy[i] * dt;
+        if(thermal) {
+            particles.x[i] += noise * thermal_noise(i, 0, pass);
+            particles.y[i] += noise * thermal_noise(i, 1, pass);
+        }
+        if(diag.active) {
+            float dx = particles.x[i] - x;
+            float dy = particles.y[i] - y;
+            diagnose_move(dx, dy);
+            diagnose_particle(i, sqrtf(dx * dx + dy * dy) / dt);
+        }
+    }
+    wrap_positions();
+
+    if(DEBUG) {
+        for(int i = 0; i < particles.count; i++) printf("New speed for particle %d... x : %f and y : %f... Pos x : %f, pos y : %f\n", i, particles.fx[i], particles.fy[i], particles.x[i], particles.y[i]);
+    }
+}
+
+// Inertial step: velocity Verlet (kick-drift-kick) with the friction applied
+// as an exact exponential decay split around the kicks, which keeps the
+// scheme symmetric. Expects fx/fy to hold the forces at the current positions.
+// At a nonzero temperature each decay becomes an Ornstein-Uhlenbeck update,
+// v = c v + sqrt(T (1 - c^2)) xi, which samples the Langevin thermostat
+// exactly for the friction part (the OBABO splitting).
+void step_verlet() {
+    float dt = choose_dt();
+    last_dt = dt;
+    sim_time += dt;
+    float damping = expf(-params.friction * dt * 0.5f);
+
+    int thermal = params.temperature > 0;
+    float noise = sqrtf(params.temperature * (1.0f - damping * damping));
+    uint64_t pass = noise_pass;
+    noise_pass += 2 * thermal;
+
+    for(int i = 0; i < particles.count; i++) {
+        particles.vx[i] = particles.vx[i] * damping + 0.5f * dt * particles.fx[i];
+        particles.vy[i] = particles.vy[i] * damping + 0.5f * dt * particles.fy[i];
+        if(thermal) {
+            particles.vx[i] += noise * thermal_noise(i, 0, pass);
+            particles.vy[i] += noise * thermal_noise(i, 1, pass);
+        }
+        particles.x[i] += particles.vx[i] * dt;
+        particles.y[i] += particles.vy[i] * dt;
+        if(diag.active) diagnose_move(particles.vx[i] * dt, particles.vy[i] * dt);
+    }
+    wrap_positions();
+
+    compute_forces();
+
+    for(int i = 0; i < particles.count; i++) {
+        particles.vx[i] = (particles.vx[i] + 0.5f * dt * particles.fx[i]) * damping;
+        particles.vy[i] = (particles.vy[i] + 0.5f * dt * particles.fy[i]) * damping;
+        if(thermal) {
+            particles.vx[i] += noise * thermal_noise(i, 0, pass + 1);
+            particles.vy[i] += noise * thermal_noise(i, 1, pass + 1);
+        }
+        if(diag.active) diagnose_particle(i, sqrtf(particles.vx[i] * particles.vx[i] + particles.vy[i] * particles.vy[i]));
+
+        if(DEBUG) printf("New speed for particle %d... x : %f and y : %f... Pos x : %f, pos y : %f\n", i, particles.vx[i], particles.vy[i], particles.x[i], particles.y[i]);
+    }
+}
+
+// Hierarchical block step covering dt_max of simulated time. Level l
+// particles are updated every 2^(levels-1-l) ticks of the finest step
+// dt_max / 2^(levels-1). Every tick all particles drift with their current
+// velocity (the force when overdamped), but only the particles that finish
+// their own step get a new force evaluation, so quiet particles on coarse
+// levels cost one force evaluation per dt_max. A particle may move to a
+// finer level at any of its step boundaries and to a coarser one only where
+// that coarser step boundary lines up with the current tick.
+void step_block() {
+    int ticks = 1 << (params.block_levels - 1);
+    float tick_dt = params.dt_max / ticks;
+    last_dt = tick_dt;
+
+    int thermal = params.temperature > 0;
+
+    for(int tick = 0; tick < ticks; tick++) {
+        // Opening half kick for inertial particles starting a step
+        if(params.inertial) {
+            uint64_t pass = noise_pass;
+            noise_pass += thermal;
+            for(int i = 0; i < particles.count; i++) {
+                int stride = ticks >> particles.level[i];
+                if(tick % stride) continue;
+                float dt = tick_dt * stride;
+                float damping = expf(-params.friction * dt * 0.5f);
+                particles.vx[i] = particles.vx[i] * damping + 0.5f * dt * particles.fx[i];
+                particles.vy[i] = particles.vy[i] * damping + 0.5f * dt * particles.fy[i];
+                if(thermal) {
+                    float noise = sqrtf(params.temperature * (1.0f - damping * damping));
+                    particles.vx[i] += noise * thermal_noise(i, 0, pass);
+                    particles.vy[i] += noise * thermal_noise(i, 1, pass);
+                }
+            }
+        }
+
+        // Overdamped particles diffuse every tick, whatever their level
+        float noise = params.inertial ? 0.0f : sqrtf(2.0f * params.temperature * tick_dt);
+        uint64_t pass = noise_pass;
+        noise_pass += thermal && !params.inertial;
+        for(int i = 0; i < particles.count; i++) {
+            float vx = params.inertial ? particles.vx[i] : particles.fx[i];
+            float vy = params.inertial ? particles.vy[i] : particles.fy[i];
+            float x = particles.x[i];
+            float y = particles.y[i];
+            particles.x[i] += vx * tick_dt;
+            particles.y[i] += vy * tick_dt;
+            if(thermal && !params.inertial) {
+                particles.x[i] += noise * thermal_noise(i, 0, pass);
+                particles.y[i] += noise * thermal_noise(i, 1, pass);
+            }
+            if(diag.active) {
+                float dx = particles.x[i] - x;
+                float dy = particles.y[i] - y;
+                diagnose_move(dx, dy);
+                // Speed over the last tick of the block
+                if(tick == ticks - 1) diagnose_particle(i, sqrtf(dx * dx + dy * dy) / tick_dt);
+            }
+        }
+        wrap_positions();
+        sim_time += tick_dt;
+
+        // Particles whose step ends here get fresh forces and a new level
+        validate_particles();
+        prepare_forces();
+        if(params.engine == ENGINE_THREADED || params.engine == ENGINE_CELLS) parallel_for(particles.count, block_force_range, &tick);
+        else block_force_range(0, particles.count, 0, &tick);
+        validate_particles();
+        pass = noise_pass;
+        noise_pass += thermal && params.inertial;
+        for(int i = 0; i < particles.count; i++) {
+            int stride = ticks >> particles.level[i];
+            if((tick + 1) % stride) continue;
+
+            if(params.inertial) {
+                float dt = tick_dt * stride;
+                float damping = expf(-params.friction * dt * 0.5f);
+                particles.vx[i] = (particles.vx[i] + 0.5f * dt * particles.fx[i]) * damping;
+                particles.vy[i] = (particles.vy[i] + 0.5f * dt * particles.fy[i]) * damping;
+                if(thermal) {
+                    float noise = sqrtf(params.temperature * (1.0f - damping * damping));
+                    particles.vx[i] += noise * thermal_noise(i, 0, pass);
+                    particles.vy[i] += noise * thermal_noise(i, 1, pass);
+                }
+            }
+
+            int level = particle_level(i);
+            while(level < particles.level[i] && (tick + 1) % (ticks >> level)) level++;
+            particles.level[i] = level;
+        }
+    }
+}
+
+// Unordered species pairs: (0, 0), (0, 1), ..., (1, 1), ...
+#define NUM_PAIRS (NUM_TYPES * (NUM_TYPES + 1) / 2)
+
+// Index of the unordered pair of species a and b
+static inline int species_pair(int a, int b) {
+    if(a > b) {
+        int swap = a;
+        a = b;
+        b = swap;
+    }
+    return a * NUM_TYPES - a * (a - 1) / 2 + b - a;
+}
+
+// Running species-resolved g(r): pair counts per bin summed over every
+// sample, and the matching ideal-gas expectation per unit area
+typedef struct rdf_state {
+    long samples;
+    float range;                     // Binned range of the samples so far
+    long *thread_bins;               // One NUM_PAIRS x RDF_BINS histogram per thread
+    int threads;                     // Histograms allocated in thread_bins
+    double total[NUM_PAIRS][RDF_BINS];
+    double ideal[NUM_PAIRS];         // Sum over samples of pairs / area
+} rdf_state;
+
+rdf_state rdf;
+
+// One thread's share of a g(r) sample: every pair closer than rdf.range,
+// found through rdf_grid and counted once (j > i), into the thread's bins
+void rdf_bin_range(long begin, long end, int thread, void *ctx) {
+    (void)ctx;
+    long *bins = rdf.thread_bins + (long)thread * NUM_PAIRS * RDF_BINS;
+    memset(bins, 0, sizeof(long) * NUM_PAIRS * RDF_BINS);
+    float range_squared = rdf.range * rdf.range;
+    float scale = RDF_BINS / rdf.range;
+    for(long i = begin; i < end; i++) {
+        int cx[3], cy[3];
+        int nx = neighbour_cells(rdf_grid.particle_cell[i] % rdf_grid.cells_x, rdf_grid.cells_x, cx);
+        int ny = neighbour_cells(rdf_grid.particle_cell[i] / rdf_grid.cells_x, rdf_grid.cells_y, cy);
+        for(int b = 0; b < ny; b++) {
+            for(int a = 0; a < nx; a++) {
+                int c = cy[b] * rdf_grid.cells_x + cx[a];
+                for(int k = rdf_grid.cell_start[c]; k < rdf_grid.cell_end[c]; k++) {
+                    int j = rdf_grid.cell_particles[k];
+                    if(j <= i) continue;
+                    float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+                    float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+                    float r_squared = x_pos * x_pos + y_pos * y_pos;
+                    if(r_squared >= range_squared) continue;
+                    int bin = (int)(sqrtf(r_squared) * scale);
+                    bins[species_pair(particles.type[i], particles.type[j]) * RDF_BINS + (bin < RDF_BINS ? bin : RDF_BINS - 1)]++;
+                }
+            }
+        }
+    }
+}
+
+// Forgets every sample taken so far
+void rdf_reset() {
+    memset(rdf.total, 0, sizeof rdf.total);
+    memset(rdf.ideal, 0, sizeof rdf.ideal);
+    rdf.samples = 0;
+}
+
+// Takes one g(r) sample of the current positions and folds it into the
+// running average. The per-thread histograms are summed in thread order,
+// so the counts do not depend on the thread count.
+void rdf_sample() {
+    float range = fminf(RDF_RANGE, 0.5f * fminf(params.width, params.height));
+    if(rdf.samples > 0 && range != rdf.range) {
+        fprintf(stderr, "g(r) range changed from %g to %g\n", rdf.range, range);
+        exit(1);
+    }
+    rdf.range = range;
+    int threads = thread_count();
+    if(rdf.threads < threads) {
+        free(rdf.thread_bins);
+        rdf.threads = threads;
+        rdf.thread_bins = malloc(sizeof(long) * threads * NUM_PAIRS * RDF_BINS);
+        if(!rdf.thread_bins) {
+            fprintf(stderr, "Cannot allocate %d g(r) histograms\n", threads);
+            exit(1);
+        }
+    }
+
+    build_cells(&rdf_grid, range, 0);
+    // parallel_for() runs fewer chunks than threads only for tiny counts
+    if(threads > particles.count) threads = particles.count > 0 ? particles.count : 1;
+    parallel_for(particles.count, rdf_bin_range, NULL);
+    for(int t = 0; t < threads; t++) {
+        const long *bins = rdf.thread_bins + (long)t * NUM_PAIRS * RDF_BINS;
+        for(int p = 0; p < NUM_PAIRS; p++) {
+            for(int b = 0; b < RDF_BINS; b++) rdf.total[p][b] += bins[p * RDF_BINS + b];
+        }
+    }
+
+    long count[NUM_TYPES] = { 0 };
+    for(int i = 0; i < particles.count; i++) count[particles.type[i]]++;
+    double area = (double)params.width * params.height;
+    for(int a = 0; a < NUM_TYPES; a++) {
+        for(int b = a; b < NUM_TYPES; b++) {
+            double pairs = a == b ? 0.5 * count[a] * (count[a] - 1) : (double)count[a] * count[b];
+            rdf.ideal[species_pair(a, b)] += pairs / area;
+        }
+    }
+    rdf.samples++;
+}
+
+// g(r) of pair p in bin b: counted pairs over the ideal-gas expectation
+// for the shell's area
+double rdf_value(int p, int b) {
+    double width = rdf.range / RDF_BINS;
+    double shell = M_PI * width * width * ((b + 1.0) * (b + 1.0) - (double)b * b);
+    return rdf.ideal[p] > 0 ? rdf.total[p][b] / (rdf.ideal[p] * shell) : 0;
+}
+
+// Rewrites params.rdf_path with the running average: the bin centre r,
+// then one g(r) column per species pair. Written to <path>.tmp and renamed
+// over it, so a reader never sees a half-written table.
+void rdf_write() {
+    char temporary[4096];
+    snprintf(temporary, sizeof temporary, "%s.tmp", params.rdf_path);
+    FILE *out = fopen(temporary, "w");
+    if(!out) {
+        fprintf(stderr, "Cannot create %s\n", temporary);
+        exit(1);
+    }
+    fprintf(out, "r");
+    for(int a = 0; a < NUM_TYPES; a++) {
+        for(int b = a; b < NUM_TYPES; b++) fprintf(out, ",g_%d_%d", a, b);
+    }
+    fprintf(out, "\n");
+    for(int b = 0; b < RDF_BINS; b++) {
+        fprintf(out, "%g", (b + 0.5) * rdf.range / RDF_BINS);
+        for(int p = 0; p < NUM_PAIRS; p++) fprintf(out, ",%g", rdf_value(p, b));
+        fprintf(out, "\n");
+    }
+    if(fclose(out) || rename(temporary, params.rdf_path)) {
+        fprintf(stderr, "Cannot write %s\n", params.rdf_path);
+        exit(1);
+    }
+}
+
+// Cluster found by detect_clusters(): the particles linked by chains of
+// pairs closer than CLUSTER_LINK
+typedef struct cluster {
+    int root;                // Smallest particle index in the cluster
+    int size;
+    int count[NUM_TYPES];    // Members per species
+    float x;                 // Centroid, periodic: the mean offset from the root added to its position
+    float y;
+    long track;              // Identity over time, set by track_clusters(); -1 when not tracking
+    double born;             // Simulated time the track first appeared
+    float vx;                // Centroid velocity since the previous detection, 0 for a new track
+    float vy;
+} cluster;
+
+cluster *cluster_list;       // Clusters of at least CLUSTER_MIN_SIZE members, by root index
+int cluster_count;
+int cluster_capacity;
+FILE *cluster_out;
+int cluster_csv;
+
+// Union-find forest of the detection, one node per particle, and each
+// particle's index in cluster_list (-1 for clusters below CLUSTER_MIN_SIZE)
+int *cluster_parent;
+int *cluster_label;
+
+// Root of i in a union-find forest shared between threads, without locks:
+// path halving with a compare-and-swap that only ever points a node at
+// one of its ancestors, so racing finds just shorten each other's paths
+static inline int concurrent_find(int *parent, int i) {
+    for(;;) {
+        int p = __atomic_load_n(&parent[i], __ATOMIC_ACQUIRE);
+        if(p == i) return i;
+        int grand = __atomic_load_n(&parent[p], __ATOMIC_ACQUIRE);
+        if(grand != p) __atomic_compare_exchange_n(&parent[i], &p, grand, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        i = grand;
+    }
+}
+
+// Lock-free union: hooks the larger of the two roots under the smaller one
+// with a compare-and-swap, retrying if another thread moved it first. Roots
+// only ever point at smaller indices, so no cycle can form and every
+// cluster ends up rooted at its smallest index whatever the interleaving.
+static inline void concurrent_unite(int *parent, int a, int b) {
+    for(;;) {
+        a = concurrent_find(parent, a);
+        b = concurrent_find(parent, b);
+        if(a == b) return;
+        if(a < b) {
+            int swap = a;
+            a = b;
+            b = swap;
+        }
+        int expected = a;
+        if(__atomic_compare_exchange_n(&parent[a], &expected, b, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+    }
+}
+
+void cluster_init_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    (void)ctx;
+    for(long i = begin; i < end; i++) cluster_parent[i] = i;
+}
+
+// One thread's share of the linking pass: every pair closer than
+// CLUSTER_LINK, found through cluster_grid, united once (j > i)
+void cluster_link_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    (void)ctx;
+    float link_squared = CLUSTER_LINK * CLUSTER_LINK;
+    for(long i = begin; i < end; i++) {
+        int cx[3], cy[3];
+        int nx = neighbour_cells(cluster_grid.particle_cell[i] % cluster_grid.cells_x, cluster_grid.cells_x, cx);
+        int ny = neighbour_cells(cluster_grid.particle_cell[i] / cluster_grid.cells_x, cluster_grid.cells_y, cy);
+        for(int b = 0; b < ny; b++) {
+            for(int a = 0; a < nx; a++) {
+                int c = cy[b] * cluster_grid.cells_x + cx[a];
+                for(int k = cluster_grid.cell_start[c]; k < cluster_grid.cell_end[c]; k++) {
+                    int j = cluster_grid.cell_particles[k];
+                    if(j <= i) continue;
+                    float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+                    float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+                    if(x_pos * x_pos + y_pos * y_pos < link_squared) concurrent_unite(cluster_parent, i, j);
+                }
+            }
+        }
+    }
+}
+
+// Points every node straight at its root, once no more unions happen
+void cluster_flatten_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    (void)ctx;
+    for(long i = begin; i < end; i++) __atomic_store_n(&cluster_parent[i], concurrent_find(cluster_parent, i), __ATOMIC_RELAXED);
+}
+
+// In-situ cluster detection: parallel initialisation, linking and
+// flattening of the union-find forest over the CLUSTER_LINK neighbour
+// graph, then a serial pass that sizes the clusters and collects the
+// composition and centroid of those with at least CLUSTER_MIN_SIZE members
+// into cluster_list. The result does not depend on the thread count.
+void detect_clusters() {
+    build_cells(&cluster_grid, CLUSTER_LINK, 0);
+    parallel_for(particles.count, cluster_init_range, NULL);
+    parallel_for(particles.count, cluster_link_range, NULL);
+    parallel_for(particles.count, cluster_flatten_range, NULL);
+
+    // cluster_label counts the members at each root, then becomes the index
+    for(int i = 0; i < particles.count; i++) cluster_label[i] = 0;
+    for(int i = 0; i < particles.count; i++) cluster_label[cluster_parent[i]]++;
+    cluster_count = 0;
+    for(int i = 0; i < particles.count; i++) {
+        if(cluster_parent[i] != i || cluster_label[i] < CLUSTER_MIN_SIZE) {
+            if(cluster_parent[i] == i) cluster_label[i] = -1;
+            continue;
+        }
+        if(cluster_count == cluster_capacity) {
+            cluster_capacity = cluster_capacity ? 2 * cluster_capacity : 64;
+            cluster_list = realloc(cluster_list, sizeof(cluster) * cluster_capacity);
+            if(!cluster_list) {
+                fprintf(stderr, "Cannot allocate %d clusters\n", cluster_capacity);
+                exit(1);
+            }
+        }
+        cluster *c = &cluster_list[cluster_count];
+        c->root = i;
+        c->size = cluster_label[i];
+        for(int t = 0; t < NUM_TYPES; t++) c->count[t] = 0;
+        c->x = c->y = 0;
+        c->track = -1;
+        c->born = sim_time;
+        c->vx = c->vy = 0;
+        cluster_label[i] = cluster_count++;
+    }
+
+    for(int i = 0; i < particles.count; i++) {
+        int root = cluster_parent[i];
+        int label = cluster_label[root];
+        cluster_label[i] = label;
+        if(label < 0) continue;
+        cluster *c = &cluster_list[label];
+        c->count[particles.type[i]]++;
+        c->x += min_image(particles.x[i] - particles.x[root], params.width);
+        c->y += min_image(particles.y[i] - particles.y[root], params.height);
+    }
+    for(int k = 0; k < cluster_count; k++) {
+        cluster *c = &cluster_list[k];
+        c->x = wrap_coordinate(particles.x[c->root] + c->x / c->size, params.width);
+        c->y = wrap_coordinate(particles.y[c->root] + c->y / c->size, params.height);
+    }
+}
+
+// Opens the cluster stream and writes the CSV header. Returns 1 when the
+// file cannot be created.
+int clustering_open() {
+    cluster_out = open_stream(params.clustering_path, &cluster_csv);
+    if(!cluster_out) return 1;
+    if(cluster_csv) {
+        fprintf(cluster_out, "step,time,size");
+        for(int t = 0; t < NUM_TYPES; t++) fprintf(cluster_out, ",count_%d", t);
+        fprintf(cluster_out, params.tracking ? ",x,y,track,age,vx,vy\n" : ",x,y\n");
+    }
+    return 0;
+}
+
+// Writes the clusters of the last detection: one CSV row per cluster, or
+// one JSON object per detection holding the list
+void clustering_emit() {
+    if(!cluster_csv) fprintf(cluster_out, "{\"step\":%ld,\"time\":%g,\"clusters\":[", step_count, sim_time);
+    for(int k = 0; k < cluster_count; k++) {
+        const cluster *c = &cluster_list[k];
+        if(cluster_csv) {
+            fprintf(cluster_out, "%ld,%g,%d", step_count, sim_time, c->size);
+            for(int t = 0; t < NUM_TYPES; t++) fprintf(cluster_out, ",%d", c->count[t]);
+            fprintf(cluster_out, ",%g,%g", c->x, c->y);
+            if(params.tracking) fprintf(cluster_out, ",%ld,%g,%g,%g", c->track, sim_time - c->born, c->vx, c->vy);
+            fprintf(cluster_out, "\n");
+            continue;
+        }
+        fprintf(cluster_out, "%s{\"size\":%d,\"count\":[", k ? "," : "", c->size);
+        for(int t = 0; t < NUM_TYPES; t++) fprintf(cluster_out, "%s%d", t ? "," : "", c->count[t]);
+        fprintf(cluster_out, "],\"x\":%g,\"y\":%g", c->x, c->y);
+        if(params.tracking) {
+            fprintf(cluster_out, ",\"track\":%ld,\"age\":%g,\"vx\":%g,\"vy\":%g", c->track, sim_time - c->born, c->vx, c->vy);
+        }
+        fprintf(cluster_out, "}");
+    }
+    if(!cluster_csv) fprintf(cluster_out, "]}\n");
+    fflush(cluster_out);
+}
+
+// Tracking state: the clusters of the previous detection and the cluster
+// each particle was in then, by particle id since the cell sort reorders
+// the indices
+cluster *previous_clusters;
+int previous_count;
+int previous_capacity;
+double previous_time;
+int *previous_label;   // -1 for particles outside every reported cluster
+long next_track;       // Id of the next new track
+FILE *track_out;       // Event stream, NULL to count events only
+int track_csv;
+long track_events[4];  // Births, deaths, splits and merges so far
+
+enum track_event { TRACK_BIRTH, TRACK_DEATH, TRACK_SPLIT, TRACK_MERGE };
+const char *track_event_names[4] = { "birth", "death", "split", "merge" };
+
+// Members shared by previous cluster p and current cluster k
+typedef struct cluster_overlap {
+    int previous;
+    int current;
+    int shared;
+} cluster_overlap;
+
+// Hash table of overlap counts keyed by (previous, current) pair, open
+// addressing with linear probing; a zero count marks a free slot
+cluster_overlap *overlap_table;
+int overlap_size;   // Power of two
+
+// Adds one shared member to the pair (p, k)
+static inline void count_overlap(int p, int k) {
+    uint64_t mask = overlap_size - 1;
+    uint64_t slot = splitmix64((uint64_t)p << 32 | (uint32_t)k) & mask;
+    while(overlap_table[slot].shared && (overlap_table[slot].previous != p || overlap_table[slot].current != k)) {
+        slot = (slot + 1) & mask;
+    }
+    overlap_table[slot].previous = p;
+    overlap_table[slot].current = k;
+    overlap_table[slot].shared++;
+}
+
+// Orders overlaps by previous cluster, then current cluster
+int compare_by_previous(const void *a, const void *b) {
+    const cluster_overlap *x = a, *y = b;
+    if(x->previous != y->previous) return x->previous < y->previous ? -1 : 1;
+    return (x->current > y->current) - (x->current < y->current);
+}
+
+// Orders overlaps by current cluster, then previous cluster
+int compare_by_current(const void *a, const void *b) {
+    const cluster_overlap *x = a, *y = b;
+    if(x->current != y->current) return x->current < y->current ? -1 : 1;
+    return (x->previous > y->previous) - (x->previous < y->previous);
+}
+
+// Opens the track event stream and writes the CSV header. Returns 1 when
+// the file cannot be created.
+int tracking_open() {
+    track_out = open_stream(params.tracking_path, &track_csv);
+    if(!track_out) return 1;
+    if(track_csv) fprintf(track_out, "step,time,event,track,partner,size,x,y,lifetime\n");
+    return 0;
+}
+
+// Writes a birth or death event for cluster c
+void emit_lifecycle(int event, const cluster *c, double lifetime) {
+    track_events[event]++;
+    if(!track_out) return;
+    if(track_csv) {
+        fprintf(track_out, "%ld,%g,%s,%ld,-1,%d,%g,%g,%g\n", step_count, sim_time, track_event_names[event], c->track,
+                c->size, c->x, c->y, lifetime);
+    }
+    else {
+        fprintf(track_out, "{\"step\":%ld,\"time\":%g,\"event\":\"%s\",\"track\":%ld,\"size\":%d,\"x\":%g,\"y\":%g",
+                step_count, sim_time, track_event_names[event], c->track, c->size, c->x, c->y);
+        if(event == TRACK_DEATH) fprintf(track_out, ",\"lifetime\":%g", lifetime);
+        fprintf(track_out, "}\n");
+    }
+}
+
+// Writes a split (one track into several) or a merge (several into one):
+// track is the one side, partners[0 .. count) the other
+void emit_branch(int event, long track, const long *partners, int count) {
+    track_events[event]++;
+    if(!track_out) return;
+    if(track_csv) {
+        for(int n = 0; n < count; n++) {
+            fprintf(track_out, "%ld,%g,%s,%ld,%ld,,,,\n", step_count, sim_time, track_event_names[event], track, partners[n]);
+        }
+        return;
+    }
+    fprintf(track_out, "{\"step\":%ld,\"time\":%g,\"event\":\"%s\",\"%s\":%ld,\"%s\":[", step_count, sim_time,
+            track_event_names[event], event == TRACK_SPLIT ? "track" : "into", track, event == TRACK_SPLIT ? "into" : "tracks");
+    for(int n = 0; n < count; n++) fprintf(track_out, "%s%ld", n ? "," : "", partners[n]);
+    fprintf(track_out, "]}\n");
+}
+
+// Matches the clusters of the last detection to those of the previous one
+// by shared members. Overlaps are counted in a hash table over the pairs
+// actually seen, so the cost is linear in the clustered particles; pairs
+// sharing at least TRACK_MIN_SHARED members are related. A cluster keeps
+// the track of the predecessor it shares most with when that predecessor
+// also shares most with it; every other cluster starts a new track.
+// Events: birth (no predecessor), death (no successor), split (several
+// successors) and merge (several predecessors).
+void track_clusters() {
+    // Overlap counts of the clustered particles that were clustered before
+    int members = 0;
+    for(int i = 0; i < particles.count; i++) members += cluster_label[i] >= 0;
+    int size = 64;
+    while(size < 2 * members) size *= 2;
+    if(size > overlap_size) {
+        free(overlap_table);
+        overlap_size = size;
+        overlap_table = malloc(sizeof(cluster_overlap) * size);
+        if(!overlap_table) {
+            fprintf(stderr, "Cannot allocate %d overlap counts\n", size);
+            exit(1);
+        }
+    }
+    memset(overlap_table, 0, sizeof(cluster_overlap) * overlap_size);
+    for(int i = 0; i < particles.count; i++) {
+        int p = previous_label[particles.id[i]];
+        if(cluster_label[i] >= 0 && p >= 0) count_overlap(p, cluster_label[i]);
+    }
+
+    // The related pairs, and the best partner on either side (most shared
+    // members, the lower index on a tie)
+    int links = 0;
+    for(int s = 0; s < overlap_size; s++) {
+        if(overlap_table[s].shared >= TRACK_MIN_SHARED) overlap_table[links++] = overlap_table[s];
+    }
+    int *best_successor = malloc(sizeof(int) * (previous_count + 1));
+    int *best_predecessor = malloc(sizeof(int) * (cluster_count + 1));
+    int *best_shared = malloc(sizeof(int) * (previous_count + cluster_count + 1));
+    long *partners = malloc(sizeof(long) * (links + 1));
+    if(!best_successor || !best_predecessor || !best_shared || !partners) {
+        fprintf(stderr, "Cannot allocate tracking tables for %d clusters\n", cluster_count);
+        exit(1);
+    }
+    for(int p = 0; p < previous_count; p++) best_successor[p] = -1;
+    for(int k = 0; k < cluster_count; k++) best_predecessor[k] = -1;
+    for(int n = 0; n < previous_count + cluster_count; n++) best_shared[n] = 0;
+    qsort(overlap_table, links, sizeof(cluster_overlap), compare_by_previous);
+    for(int l = 0; l < links; l++) {
+        const cluster_overlap *o = &overlap_table[l];
+        if(o->shared > best_shared[o->previous]) {
+            best_shared[o->previous] = o->shared;
+            best_successor[o->previous] = o->current;
+        }
+        if(o->shared > best_shared[previous_count + o->current]) {
+            best_shared[previous_count + o->current] = o->shared;
+            best_predecessor[o->current] = o->previous;
+        }
+    }
+
+    // Identities, velocities and births
+    double elapsed = sim_time - previous_time;
+    for(int k = 0; k < cluster_count; k++) {
+        cluster *c = &cluster_list[k];
+        int p = best_predecessor[k];
+        if(p >= 0 && best_successor[p] == k) {
+            const cluster *before = &previous_clusters[p];
+            c->track = before->track;
+            c->born = before->born;
+            if(elapsed > 0) {
+                c->vx = min_image(c->x - before->x, params.width) / elapsed;
+                c->vy = min_image(c->y - before->y, params.height) / elapsed;
+            }
+            continue;
+        }
+        c->track = next_track++;
+        if(p < 0) emit_lifecycle(TRACK_BIRTH, c, 0);
+    }
+
+    // Deaths and splits, grouped by previous cluster
+    for(int p = 0; p < previous_count; p++) {
+        if(best_successor[p] < 0) emit_lifecycle(TRACK_DEATH, &previous_clusters[p], previous_time - previous_clusters[p].born);
+    }
+    for(int l = 0; l < links;) {
+        int count = 0, p = overlap_table[l].previous;
+        for(; l < links && overlap_table[l].previous == p; l++) partners[count++] = cluster_list[overlap_table[l].current].track;
+        if(count > 1) emit_branch(TRACK_SPLIT, previous_clusters[p].track, partners, count);
+    }
+
+    // Merges, grouped by current cluster
+    qsort(overlap_table, links, sizeof(cluster_overlap), compare_by_current);
+    for(int l = 0; l < links;) {
+        int count = 0, k = overlap_table[l].current;
+        for(; l < links && overlap_table[l].current == k; l++) partners[count++] = previous_clusters[overlap_table[l].previous].track;
+        if(count > 1) emit_branch(TRACK_MERGE, cluster_list[k].track, partners, count);
+    }
+    if(track_out) fflush(track_out);
+    free(best_successor);
+    free(best_predecessor);
+    free(best_shared);
+    free(partners);
+
+    // This detection becomes the previous one
+    if(cluster_count > previous_capacity) {
+        free(previous_clusters);
+        previous_capacity = cluster_capacity;
+        previous_clusters = malloc(sizeof(cluster) * previous_capacity);
+        if(!previous_clusters) {
+            fprintf(stderr, "Cannot allocate %d clusters\n", previous_capacity);
+            exit(1);
+        }
+    }
+    memcpy(previous_clusters, cluster_list, sizeof(cluster) * cluster_count);
+    previous_count = cluster_count;
+    previous_time = sim_time;
+    for(int i = 0; i < particles.count; i++) previous_label[particles.id[i]] = cluster_label[i];
+}
+
+// Layout of the live export segment: this header, then two frame buffers
+// of frame_bytes each at header_bytes and header_bytes + frame_bytes. Every
+// buffer is an export_frame followed by capacity floats of x, capacity of
+// y, capacity int32 types and capacity int32 particle ids (the cell sort
+// reorders the particles, the ids do not change).
+//
+// The writer fills the buffers alternately, each under a seqlock: its
+// sequence is odd while it is written, and frames counts the frames
+// completed, the newest being in buffer (frames - 1) & 1. A reader copies
+// the newest buffer and keeps the copy if the sequence was even and
+// unchanged around it (export_read()). The writer never waits for readers,
+// and a reader only retries when it is still copying a buffer a full frame
+// later, when the writer comes back to it.
+typedef struct export_header {
+    uint32_t magic;          // EXPORT_MAGIC
+    uint32_t version;        // EXPORT_VERSION
+    uint32_t capacity;       // Particles a buffer holds
+    uint32_t num_types;
+    float width;             // Domain
+    float height;
+    uint64_t header_bytes;   // Offset of buffer 0
+    uint64_t frame_bytes;    // Size of one buffer
+    uint64_t sequence[2];    // Seqlock of each buffer, odd while it is written
+    uint64_t frames;         // Frames published so far
+    uint32_t closed;         // Set when the writer exits
+    uint32_t reserved;
+} export_header;
+
+typedef struct export_frame {
+    uint64_t number;         // Frame number, from 1
+    uint64_t step;
+    double time;
+    uint32_t count;          // Particles in this frame
+    uint32_t reserved;
+} export_frame;
+
+export_header *exported;     // Mapped segment of the writer, NULL when not exporting
+size_t exported_bytes;
+char export_path[256];       // Name of the segment, with its leading '/'
+
+// Start of buffer b and of its arrays
+static inline export_frame *export_buffer(const export_header *h, int b) {
+    return (export_frame *)((char *)h + h->header_bytes + b * h->frame_bytes);
+}
+
+static inline float *export_x(const export_header *h, export_frame *f) {
+    (void)h;
+    return (float *)(f + 1);
+}
+
+static inline float *export_y(const export_header *h, export_frame *f) {
+    return export_x(h, f) + h->capacity;
+}
+
+static inline int32_t *export_type(const export_header *h, export_frame *f) {
+    return (int32_t *)(export_y(h, f) + h->capacity);
+}
+
+static inline int32_t *export_id(const export_header *h, export_frame *f) {
+    return export_type(h, f) + h->capacity;
+}
+
+// Publishes the current state into the buffer after the newest one
+void export_publish() {
+    export_header *h = exported;
+    uint64_t frames = h->frames;
+    int b = frames & 1;
+    uint64_t sequence = h->sequence[b];
+    __atomic_store_n(&h->sequence[b], sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    export_frame *f = export_buffer(h, b);
+    f->number = frames + 1;
+    f->step = step_count;
+    f->time = sim_time;
+    f->count = particles.count;
+    memcpy(export_x(h, f), particles.x, sizeof(float) * particles.count);
+    memcpy(export_y(h, f), particles.y, sizeof(float) * particles.count);
+    memcpy(export_type(h, f), particles.type, sizeof(int32_t) * particles.count);
+    memcpy(export_id(h, f), particles.id, sizeof(int32_t) * particles.count);
+
+    __atomic_store_n(&h->sequence[b], sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->frames, frames + 1, __ATOMIC_RELEASE);
+}
+
+// Copies the newest frame of segment h: the frame header into *frame and
+// its arrays into x, y, type and id (any may be NULL), capacity entries
+// each. Returns the number of the frame copied (from 1), taken from the
+// copy itself since the writer may have published more meanwhile, or 0
+// when nothing was published yet or the writer kept overwriting the buffer.
+uint64_t export_read(const export_header *h, export_frame *frame, float *x, float *y, int32_t *type, int32_t *id) {
+    for(int attempt = 0; attempt < EXPORT_RETRIES; attempt++) {
+        uint64_t frames = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+        if(!frames) return 0;
+        int b = (frames - 1) & 1;
+        uint64_t before = __atomic_load_n(&h->sequence[b], __ATOMIC_ACQUIRE);
+        if(before & 1) continue;
+
+        export_frame *f = export_buffer(h, b);
+        memcpy(frame, f, sizeof *frame);
+        uint32_t count = frame->count < h->capacity ? frame->count : h->capacity;
+        if(x) memcpy(x, export_x(h, f), sizeof(float) * count);
+        if(y) memcpy(y, export_y(h, f), sizeof(float) * count);
+        if(type) memcpy(type, export_type(h, f), sizeof(int32_t) * count);
+        if(id) memcpy(id, export_id(h, f), sizeof(int32_t) * count);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&h->sequence[b], __ATOMIC_RELAXED) == before) return frame->number;
+    }
+    return 0;
+}
+
+// Unmaps and removes the segment; readers that mapped it keep their view.
+// Registered with atexit(), so a run killed by a signal leaves the segment
+// behind until the next export of the same name replaces it.
+void export_close() {
+    if(!exported) return;
+    __atomic_store_n(&exported->closed, 1, __ATOMIC_RELEASE);
+    munmap(exported, exported_bytes);
+    shm_unlink(export_path);
+    exported = NULL;
+}
+
+// Creates the segment params.export_name for the current particles and
+// publishes the initial state. Returns 1 when it cannot be created.
+int export_open() {
+    snprintf(export_path, sizeof export_path, "%s%s", params.export_name[0] == '/' ? "" : "/", params.export_name);
+    size_t header_bytes = (sizeof(export_header) + 63) & ~(size_t)63;
+    size_t frame_bytes = (sizeof(export_frame) + 16 * (size_t)particles.count + 63) & ~(size_t)63;
+    exported_bytes = header_bytes + 2 * frame_bytes;
+
+    int fd = shm_open(export_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, exported_bytes)) {
+        fprintf(stderr, "Cannot create shared memory %s\n", export_path);
+        if(fd >= 0) close(fd);
+        return 1;
+    }
+    void *segment = mmap(NULL, exported_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED) {
+        fprintf(stderr, "Cannot map shared memory %s\n", export_path);
+        shm_unlink(export_path);
+        return 1;
+    }
+    exported = segment;
+    exported->capacity = particles.count;
+    exported->num_types = NUM_TYPES;
+    exported->width = params.width;
+    exported->height = params.height;
+    exported->header_bytes = header_bytes;
+    exported->frame_bytes = frame_bytes;
+    exported->version = EXPORT_VERSION;
+    __atomic_store_n(&exported->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+    export_publish();
+    return 0;
+}
+
+// Maps the segment name read-only. Returns NULL when it does not exist or
+// is not a live export of this layout.
+const export_header *export_attach(const char *name, size_t *bytes) {
+    char path[256];
+    snprintf(path, sizeof path, "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if(fd < 0) {
+        fprintf(stderr, "Cannot open shared memory %s\n", path);
+        return NULL;
+    }
+    struct stat info;
+    const export_header *h = NULL;
+    if(!fstat(fd, &info) && (size_t)info.st_size >= sizeof(export_header)) {
+        void *segment = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(segment != MAP_FAILED) h = segment;
+    }
+    close(fd);
+    if(h && (h->magic != EXPORT_MAGIC || h->version != EXPORT_VERSION ||
+             h->header_bytes + 2 * h->frame_bytes > (uint64_t)info.st_size)) {
+        fprintf(stderr, "%s is not a version %d particle export\n", path, EXPORT_VERSION);
+        munmap((void *)h, info.st_size);
+        return NULL;
+    }
+    if(!h) fprintf(stderr, "Cannot map shared memory %s\n", path);
+    *bytes = info.st_size;
+    return h;
+}
+
+// Follows the export name from another process, printing a summary of the
+// newest frame about ten times a second until the writer exits
+int watch_export(const char *name) {
+    size_t bytes;
+    const export_header *h = export_attach(name, &bytes);
+    if(!h) return 1;
+    int32_t *type = malloc(sizeof(int32_t) * (h->capacity + 1));
+    if(!type) {
+        fprintf(stderr, "Cannot allocate %u types\n", h->capacity);
+        exit(1);
+    }
+    uint64_t seen = 0;
+    while(1) {
+        int closed = __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE);
+        export_frame frame;
+        uint64_t frames = export_read(h, &frame, NULL, NULL, type, NULL);
+        if(frames > seen) {
+            int count[NUM_TYPES] = { 0 };
+            for(uint32_t i = 0; i < frame.count && i < h->capacity; i++) {
+                if(type[i] >= 0 && type[i] < NUM_TYPES) count[type[i]]++;
+            }
+            printf("frame %lu: step %lu, time %g, %u particles (", (unsigned long)frames, (unsigned long)frame.step,
+                   frame.time, frame.count);
+            for(int t = 0; t < NUM_TYPES; t++) printf("%s%d", t ? " " : "", count[t]);
+            printf("), %lu frame(s) skipped\n", (unsigned long)(frames - seen - 1));
+            fflush(stdout);
+            seen = frames;
+        }
+        if(closed) break;
+        usleep(100000);
+    }
+    free(type);
+    munmap((void *)h, bytes);
+    return 0;
+}
+
+// Writes the particles in the --load format, "x y type" per line, in the
+// order of their ids so that a reloaded run numbers them the same way.
+// Returns 1 when the file cannot be written.
+int save_particles(const char *path) {
+    FILE *file = fopen(path, "w");
+    int *order = malloc(sizeof(int) * (particles.count + 1));
+    if(!file || !order) {
+        if(file) fclose(file);
+        free(order);
+        return 1;
+    }
+    for(int i = 0; i < particles.count; i++) order[particles.id[i]] = i;
+    fprintf(file, "# step %ld, time %g, %d particles\n", step_count, sim_time, particles.count);
+    for(int k = 0; k < particles.count; k++) {
+        int i = order[k];
+        fprintf(file, "%.9g %.9g %d\n", particles.x[i], particles.y[i], particles.type[i]);
+    }
+    free(order);
+    return fclose(file) ? 1 : 0;
+}
+
+// One connection of the control channel. Its commands are handled one at
+// a time, in order: stats by the server thread from the latest published
+// figures, everything else by the simulation thread between two steps.
+typedef struct control_client {
+    int fd;                      // -1: free slot
+    int queued;                  // command waits for the simulation thread
+    int in_length;
+    char in[CONTROL_LINE];       // Received, not handled yet
+    char command[CONTROL_LINE];
+    int out_length;
+    char out[4 * CONTROL_LINE];  // Replies not sent yet
+} control_client;
+
+// Figures of the run for stats, published by the simulation thread
+typedef struct control_stats {
+    long step;
+    double time;
+    int particles;
+    double steps_per_second;
+    int paused;
+    float sleeping;
+    float dt;
+    float temperature;
+} control_stats;
+
+// The control server. The simulation thread only ever tries the lock, so a
+// busy server delays a command by a step instead of stalling the run.
+typedef struct control_server {
+    int listener;                // -1 when not serving
+    int wake[2];                 // Self-pipe waking the server: replies to send, or time to stop
+    pthread_t thread;
+    pthread_mutex_t lock;        // Guards clients, stats and stopping
+    control_client clients[CONTROL_CLIENTS];
+    control_stats stats;
+    int stopping;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    // Owned by the simulation thread
+    int paused;
+    int stop;                    // A stop command ended the run
+    double rate;                 // Steps per second over the last half second or more
+    long rate_step;
+    struct timespec rate_time;
+} control_server;
+
+control_server control = { .listener = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Parameters the set command changes; values below lowest are refused
+typedef struct control_setting {
+    const char *name;
+    float *value;
+    float lowest;
+    int squared;   // Set as a length, stored squared
+} control_setting;
+
+const control_setting control_settings[] = {
+    { "dt", &params.dt, 1e-6f, 0 },
+    { "friction", &params.friction, 0, 0 },
+    { "temperature", &params.temperature, 0, 0 },
+    { "softening", &params.softening, 0, 0 },
+    { "repulsion", &params.repulsion, 0, 0 },
+    { "radius_min", &params.radius_min_squared, 1e-6f, 1 },
+    { "max_displacement", &params.max_displacement, 1e-6f, 0 },
+};
+
+// Runs one command on the simulation thread and writes its one line reply:
+//   pause, resume, stop                    "ok"
+//   set NAME VALUE                         a control_settings entry
+//   set interaction A B VALUE              interaction[A][B]
+//   snapshot PATH                          the particles, as for --load
+// and "error ..." for anything else. stats never gets here, see
+// control_advance().
+void control_execute(char *command, char *reply, int size) {
+    char *verb = strtok(command, " \t");
+    char *argument = strtok(NULL, " \t");
+    if(!strcmp(verb, "pause") || !strcmp(verb, "resume")) {
+        control.paused = !strcmp(verb, "pause");
+        snprintf(reply, size, "ok");
+    }
+    else if(!strcmp(verb, "stop")) {
+        control.stop = 1;
+        snprintf(reply, size, "ok");
+    }
+    else if(!strcmp(verb, "snapshot") && argument) {
+        if(save_particles(argument)) snprintf(reply, size, "error cannot write %s", argument);
+        else snprintf(reply, size, "ok %d particles", particles.count);
+    }
+    else if(!strcmp(verb, "set") && argument && !strcmp(argument, "interaction")) {
+        char *a = strtok(NULL, " \t"), *b = strtok(NULL, " \t"), *value = strtok(NULL, " \t"), *end = NULL;
+        int ta = a ? atoi(a) : -1, tb = b ? atoi(b) : -1;
+        float v = value ? strtof(value, &end) : 0;
+        if(ta < 0 || ta >= NUM_TYPES || tb < 0 || tb >= NUM_TYPES || !end || *end || non_finite(v)) {
+            snprintf(reply, size, "error usage: set interaction A B VALUE, species below %d", NUM_TYPES);
+            return;
+        }
+        interaction[ta][tb] = v;
+        snprintf(reply, size, "ok");
+    }
+    else if(!strcmp(verb, "set") && argument) {
+        char *value = strtok(NULL, " \t"), *end = NULL;
+        float v = value ? strtof(value, &end) : 0;
+        for(unsigned k = 0; k < sizeof control_settings / sizeof *control_settings; k++) {
+            const control_setting *setting = &control_settings[k];
+            if(strcmp(argument, setting->name)) continue;
+            if(!end || *end || non_finite(v) || v < setting->lowest) {
+                snprintf(reply, size, "error %s needs a number of at least %g", setting->name, setting->lowest);
+                return;
+            }
+            *setting->value = setting->squared ? v * v : v;
+            snprintf(reply, size, "ok");
+            return;
+        }
+        snprintf(reply, size, "error unknown parameter %s", argument);
+    }
+    else snprintf(reply, size, "error unknown command %s", verb);
+}
+
+// Queues one reply line for c; a client that lets its replies pile up is
+// dropped. Called with the lock held.
+void control_append(control_client *c, const char *reply) {
+    int length = strlen(reply);
+    if(c->out_length + length + 1 > (int)sizeof c->out) {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    memcpy(c->out + c->out_length, reply, length);
+    c->out[c->out_length + length] = '\n';
+    c->out_length += length + 1;
+}
+
+// Takes the next commands of c while none is queued, answers stats right
+// away, and sends what replies the socket takes. Called with the lock held.
+void control_advance(control_client *c) {
+    while(c->fd >= 0 && !c->queued) {
+        char *newline = memchr(c->in, '\n', c->in_length);
+        if(!newline) {
+            if(c->in_length == CONTROL_LINE - 1) {
+                control_append(c, "error line too long");
+                c->in_length = 0;
+            }
+            break;
+        }
+        int length = newline - c->in;
+        memcpy(c->command, c->in, length);
+        c->command[length] = 0;
+        if(length && c->command[length - 1] == '\r') c->command[length - 1] = 0;
+        c->in_length -= length + 1;
+        memmove(c->in, newline + 1, c->in_length);
+
+        if(!strcmp(c->command, "stats")) {
+            const control_stats *stats = &control.stats;
+            char reply[CONTROL_LINE];
+            snprintf(reply, sizeof reply, "{\"step\":%ld,\"time\":%g,\"particles\":%d,\"steps_per_second\":%.1f,"
+                     "\"paused\":%d,\"sleeping\":%g,\"dt\":%g,\"temperature\":%g}", stats->step, stats->time,
+                     stats->particles, stats->steps_per_second, stats->paused, stats->sleeping, stats->dt, stats->temperature);
+            control_append(c, reply);
+        }
+        else if(c->command[strspn(c->command, " \t")]) c->queued = 1;
+    }
+    while(c->fd >= 0 && c->out_length) {
+        ssize_t sent = send(c->fd, c->out, c->out_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+        if(sent <= 0) {
+            close(c->fd);
+            c->fd = -1;
+            break;
+        }
+        c->out_length -= sent;
+        memmove(c->out, c->out + sent, c->out_length);
+    }
+}
+
+// Event loop of the control server thread: one poll() over the listening
+// socket, the wake pipe and the clients, all non-blocking
+void *control_serve(void *arg) {
+    (void)arg;
+    struct pollfd fds[CONTROL_CLIENTS + 2];
+    int slots[CONTROL_CLIENTS + 2];
+    while(1) {
+        int count = 2;
+        fds[0] = (struct pollfd){ control.listener, POLLIN, 0 };
+        fds[1] = (struct pollfd){ control.wake[0], POLLIN, 0 };
+        pthread_mutex_lock(&control.lock);
+        int stopping = control.stopping;
+        for(int c = 0; c < CONTROL_CLIENTS; c++) {
+            const control_client *client = &control.clients[c];
+            if(client->fd < 0) continue;
+            // A full input buffer only happens behind a queued command: stop
+            // reading until the simulation thread has run it (its wake write
+            // brings the client back), or an EOF check would see recv() of 0
+            short events = (client->in_length < CONTROL_LINE - 1 ? POLLIN : 0) | (client->out_length ? POLLOUT : 0);
+            if(!events) continue;
+            slots[count] = c;
+            fds[count++] = (struct pollfd){ client->fd, events, 0 };
+        }
+        pthread_mutex_unlock(&control.lock);
+        if(stopping) break;
+        if(poll(fds, count, -1) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Control server stopped: poll failed\n");
+            break;
+        }
+
+        char drain[64];
+        if(fds[1].revents & POLLIN) while(read(control.wake[0], drain, sizeof drain) > 0) {}
+        pthread_mutex_lock(&control.lock);
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while((fd = accept(control.listener, NULL, NULL)) >= 0) {
+                int c = 0;
+                while(c < CONTROL_CLIENTS && control.clients[c].fd >= 0) c++;
+                if(c == CONTROL_CLIENTS || fcntl(fd, F_SETFL, O_NONBLOCK)) {
+                    close(fd);
+                    continue;
+                }
+                control.clients[c] = (control_client){ .fd = fd };
+            }
+        }
+        for(int k = 2; k < count; k++) {
+            control_client *client = &control.clients[slots[k]];
+            if(client->fd != fds[k].fd || !(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if(client->in_length == CONTROL_LINE - 1) continue;   // Hangups then show up in the send
+            ssize_t got = recv(client->fd, client->in + client->in_length, CONTROL_LINE - 1 - client->in_length, 0);
+            if(got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close(client->fd);
+                client->fd = -1;
+            }
+            else if(got > 0) client->in_length += got;
+        }
+        for(int c = 0; c < CONTROL_CLIENTS; c++) control_advance(&control.clients[c]);
+        pthread_mutex_unlock(&control.lock);
+    }
+    return NULL;
+}
+
+// Publishes the stats and runs the queued commands; called by the
+// simulation thread between steps. Does nothing when the server holds the
+// lock, the commands then run at the next call.
+void control_poll() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - control.rate_time.tv_sec) + (now.tv_nsec - control.rate_time.tv_nsec) * 1e-9;
+    if(elapsed >= 0.5) {
+        control.rate = (step_count - control.rate_step) / elapsed;
+        control.rate_step = step_count;
+        control.rate_time = now;
+    }
+    if(pthread_mutex_trylock(&control.lock)) return;
+
+    int answered = 0;
+    for(int c = 0; c < CONTROL_CLIENTS; c++) {
+        control_client *client = &control.clients[c];
+        if(client->fd < 0 || !client->queued) continue;
+        char reply[CONTROL_LINE];
+        control_execute(client->command, reply, sizeof reply);
+        control_append(client, reply);
+        client->queued = 0;
+        answered = 1;
+    }
+    control.stats = (control_stats){ step_count, sim_time, particles.count, control.rate, control.paused,
+                                     sleeping_fraction, last_dt, params.temperature };
+    pthread_mutex_unlock(&control.lock);
+    if(answered && write(control.wake[1], "", 1) < 0) {
+        // The pipe is full, so the server is awake already
+    }
+}
+
+// Called before every headless step: runs the queued commands, and while
+// paused keeps doing so without stepping. Returns 1 once a stop command
+// ended the run.
+int control_wait() {
+    control_poll();
+    while(control.paused && !control.stop) {
+        usleep(CONTROL_PAUSE_POLL);
+        control_poll();
+    }
+    return control.stop;
+}
+
+// Stops the server thread and removes the socket
+void control_close() {
+    if(control.listener < 0) return;
+    pthread_mutex_lock(&control.lock);
+    control.stopping = 1;
+    pthread_mutex_unlock(&control.lock);
+    if(write(control.wake[1], "", 1) < 0) {
+        // Full pipe: the server wakes anyway
+    }
+    pthread_join(control.thread, NULL);
+    for(int c = 0; c < CONTROL_CLIENTS; c++) if(control.clients[c].fd >= 0) close(control.clients[c].fd);
+    close(control.listener);
+    close(control.wake[0]);
+    close(control.wake[1]);
+    unlink(control.path);
+    control.listener = -1;
+}
+
+// Listens on the socket params.control_path and starts the server thread.
+// A socket left behind by a killed run is replaced, any other file is not.
+// Returns 1 when the socket cannot be set up.
+int control_open() {
+    const char *path = params.control_path;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof address.sun_path) {
+        fprintf(stderr, "Control socket path %s is too long\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    strcpy(control.path, path);
+    struct stat info;
+    if(!lstat(path, &info) && S_ISSOCK(info.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof address) || listen(fd, CONTROL_CLIENTS) ||
+       fcntl(fd, F_SETFL, O_NONBLOCK) || pipe(control.wake)) {
+        fprintf(stderr, "Cannot listen on %s\n", path);
+        if(fd >= 0) close(fd);
+        return 1;
+    }
+    fcntl(control.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(control.wake[1], F_SETFL, O_NONBLOCK);
+    for(int c = 0; c < CONTROL_CLIENTS; c++) control.clients[c].fd = -1;
+    control.listener = fd;
+    control.stopping = control.paused = control.stop = 0;
+    control.rate = 0;
+    control.rate_step = step_count;
+    clock_gettime(CLOCK_MONOTONIC, &control.rate_time);
+    control_poll();
+    if(pthread_create(&control.thread, NULL, control_serve, NULL)) {
+        fprintf(stderr, "Cannot start the control server\n");
+        close(fd);
+        close(control.wake[0]);
+        close(control.wake[1]);
+        unlink(path);
+        control.listener = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Advances the simulation by one time step with the selected integrator
+// (one full block of dt_max when block time steps are enabled)
+void step() {
+    if(params.diagnostics > 0 && (step_count + 1) % params.diagnostics == 0) diagnostics_begin();
+    if(params.block_levels > 0) step_block();
+    else if(params.inertial) step_verlet();
+    else step_overdamped();
+    step_count++;
+    // A record begun outside step() (the last step of a sweep run) is
+    // ended by whoever began it
+    if(diag.active && params.diagnostics > 0) diagnostics_emit();
+    if(params.rdf > 0 && step_count % params.rdf == 0) {
+        rdf_sample();
+        rdf_write();
+    }
+    if(params.clustering > 0 && step_count % params.clustering == 0) {
+        detect_clusters();
+        if(params.tracking) track_clusters();
+        clustering_emit();
+    }
+    if(exported && step_count % params.export_interval == 0) export_publish();
+}
+
+// Aligned, uninitialised array of count elements; exits when out of memory.
+// Left untouched so the threads filling it first also fault its pages in.
+void *alloc_array(long count, size_t size) {
+    size_t bytes = (count * size + 63) / 64 * 64;
+    void *array = aligned_alloc(64, bytes ? bytes : 64);
+    if(!array) {
+        fprintf(stderr, "Cannot allocate %ld particles\n", count);
+        exit(1);
+    }
+    return array;
+}
+
+// Puts slot i at rest: no velocity or force, free, awake and unlabelled,
+// with id i. Everything but position and type, which the caller sets.
+static inline void reset_particle(long i) {
+    particles.vx[i] = particles.vy[i] = 0;
+    particles.fx[i] = particles.fy[i] = 0;
+    particles.level[i] = 0;
+    particles.aggregate[i] = -1;
+    lod_seen[i] = 0;
+    particles.moved[i] = 0;
+    particles.quiet[i] = 0;
+    particles.id[i] = i;
+    grid.particle_cell[i] = 0;
+    previous_label[i] = -1;
+}
+
+// (Re)allocates the particle arrays and everything sized by the particle
+// count. Padding slots are set here; the generators fill [0, count), each
+// thread its own chunk, so those pages fault in where they are used.
+void particles_alloc(int count) {
+    free(particles.type);
+    free(particles.x);
+    free(particles.y);
+    free(particles.vx);
+    free(particles.vy);
+    free(particles.fx);
+    free(particles.fy);
+    free(particles.level);
+    free(particles.aggregate);
+    free(particles.moved);
+    free(particles.quiet);
+    free(particles.id);
+    for(int f = 0; f < NUM_PARTICLE_FIELDS; f++) free(sort_scratch[f]);
+    free(sort_destination);
+    free(grid.particle_cell);
+    free(grid.particle_slot);
+    free(wake_grid.particle_cell);
+    free(wake_grid.particle_slot);
+    free(rdf_grid.particle_cell);
+    free(rdf_grid.particle_slot);
+    free(cluster_grid.particle_cell);
+    free(cluster_grid.particle_slot);
+    free(cluster_parent);
+    free(cluster_label);
+    free(previous_label);
+    for(int t = 0; t < NUM_TYPES; t++) free(species_coef[t]);
+    free(aggregates);
+    free(lod_free);
+    free(lod_seen);
+    free(lod_x);
+    free(lod_y);
+    for(int t = 0; t < NUM_TYPES; t++) free(lod_coef[t]);
+
+    particles.count = count;
+    particles.padded = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    int padded = particles.padded;
+    particles.type = alloc_array(padded, sizeof(int));
+    particles.x = alloc_array(padded, sizeof(float));
+    particles.y = alloc_array(padded, sizeof(float));
+    particles.vx = alloc_array(padded, sizeof(float));
+    particles.vy = alloc_array(padded, sizeof(float));
+    particles.fx = alloc_array(padded, sizeof(float));
+    particles.fy = alloc_array(padded, sizeof(float));
+    particles.level = alloc_array(padded, sizeof(int));
+    particles.aggregate = alloc_array(padded, sizeof(int));
+    particles.moved = alloc_array(padded, sizeof(float));
+    particles.quiet = alloc_array(padded, sizeof(int));
+    particles.id = alloc_array(padded, sizeof(int));
+    grid.particle_cell = alloc_array(padded, sizeof(int));
+    grid.particle_slot = alloc_array(padded, sizeof(int));
+    grid.stale = 1;
+    wake_grid.particle_cell = alloc_array(padded, sizeof(int));
+    wake_grid.particle_slot = alloc_array(padded, sizeof(int));
+    wake_grid.stale = 1;
+    rdf_grid.particle_cell = alloc_array(padded, sizeof(int));
+    rdf_grid.particle_slot = alloc_array(padded, sizeof(int));
+    cluster_grid.particle_cell = alloc_array(padded, sizeof(int));
+    cluster_grid.particle_slot = alloc_array(padded, sizeof(int));
+    cluster_parent = alloc_array(padded, sizeof(int));
+    cluster_label = alloc_array(padded, sizeof(int));
+    previous_label = alloc_array(padded, sizeof(int));
+    for(int t = 0; t < NUM_TYPES; t++) species_coef[t] = alloc_array(padded, sizeof(float));
+    aggregates = alloc_array(count / LOD_MIN_MEMBERS + 1, sizeof(aggregate));
+    aggregate_count = 0;
+    lod_free = alloc_array(padded, sizeof(int));
+    lod_seen = alloc_array(padded, sizeof(int));
+    lod_x = alloc_array(padded, sizeof(float));
+    lod_y = alloc_array(padded, sizeof(float));
+    for(int t = 0; t < NUM_TYPES; t++) lod_coef[t] = alloc_array(padded, sizeof(float));
+
+    // Padding slots sit at the origin; [0, count) is left to the generator
+    // or loader, which also puts those slots at rest (see reset_particle())
+    for(int i = count; i < padded; i++) {
+        particles.type[i] = 0;
+        particles.x[i] = particles.y[i] = 0;
+        reset_particle(i);
+    }
+
+    // Scratch padding starts as a copy, so it stays valid whichever buffer
+    // is live; the sort writes the rest
+    for(int f = 0; f < NUM_PARTICLE_FIELDS; f++) {
+        sort_scratch[f] = alloc_array(padded, sizeof(uint32_t));
+        memcpy(sort_scratch[f] + count, *particle_fields[f] + count, sizeof(uint32_t) * (padded - count));
+    }
+    sort_destination = alloc_array(padded, sizeof(int));
+}
+
+// Species of particle i: cycles through the types, or is drawn from the
+// particle's stream with the probabilities given by params.mix (which sum
+// to total)
+static inline int particle_type(long i, uint64_t key, float total) {
+    if(total <= 0) return i % NUM_TYPES;
+
+    float u = rng_float(rng_at(key, 4)) * total;
+    int type = 0;
+    for(int t = 0; t < NUM_TYPES - 1; t++) {
+        u -= params.mix[t];
+        type += u >= 0;
+    }
+    return type;
+}
+
+// Places particles [begin, end) with the selected generator, each from its
+// own placement stream, so the layout does not depend on the thread count
+void place_range(long begin, long end, int thread, void *ctx) {
+    (void)thread;
+    (void)ctx;
+    float width = params.width;
+    float height = params.height;
+    float mix_total = 0;
+    for(int t = 0; t < NUM_TYPES; t++) mix_total += params.mix[t];
+
+    // Lattice shape: columns x rows cells of the domain's aspect ratio
+    int columns = (int)ceilf(sqrtf(particles.count * width / height));
+    if(columns < 1) columns = 1;
+    int rows = (particles.count + columns - 1) / columns;
+
+    for(long i = begin; i < end; i++) {
+        uint64_t key = rng_key(sim_seed, RNG_PLACEMENT, i);
+        float u0 = rng_float(rng_at(key, 0));
+        float u1 = rng_float(rng_at(key, 1));
+        float x, y;
+
+        if(params.init == INIT_CLUSTERED) {
+            // Centre c is the same pair of draws for every particle in it
+            uint64_t c = rng_at(key, 2) % params.clusters;
+            uint64_t centre = rng_key(sim_seed, RNG_CLUSTERS, c);
+            float g0, g1;
+            rng_gaussian2(rng_at(key, 0), rng_at(key, 1), &g0, &g1);
+            x = rng_float(rng_at(centre, 0)) * width + g0 * params.cluster_spread;
+            y = rng_float(rng_at(centre, 1)) * height + g1 * params.cluster_spread;
+        }
+        else if(params.init == INIT_DISK) {
+            // sqrt keeps the density uniform over the disk area
+            float radius = DISK_RADIUS * fminf(width, height) * sqrtf(u0);
+            float angle = 6.28318531f * u1;
+            x = 0.5f * width + radius * cosf(angle);
+            y = 0.5f * height + radius * sinf(angle);
+        }
+        else if(params.init == INIT_LATTICE) {
+            x = (i % columns + 0.5f) * width / columns;
+            y = (i / columns + 0.5f) * height / rows;
+        }
+        else {
+            x = u0 * width;
+            y = u1 * height;
+        }
+
+        particles.x[i] = wrap_coordinate(x, width);
+        particles.y[i] = wrap_coordinate(y, height);
+        particles.type[i] = particle_type(i, key, mix_total);
+        reset_particle(i);
+    }
+}
+
+// Reads particles from a text file with one "x y type" line per particle
+// ('#' starts a comment line). Positions are wrapped into the domain.
+// Returns 0 on success, prints the problem and returns -1 otherwise.
+int load_particles(const char *path) {
+    FILE *file = fopen(path, "r");
+    if(!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+
+    // First pass counts, second pass fills
+    char line[256];
+    int count = 0;
+    while(fgets(line, sizeof line, file)) {
+        float x, y;
+        int type;
+        if(line[0] != '#' && sscanf(line, "%f %f %d", &x, &y, &type) == 3) count++;
+    }
+    particles_alloc(count);
+    rewind(file);
+
+    int i = 0;
+    int line_number = 0;
+    while(i < count && fgets(line, sizeof line, file)) {
+        float x, y;
+        int type;
+        line_number++;
+        if(line[0] == '#' || sscanf(line, "%f %f %d", &x, &y, &type) != 3) continue;
+        if(type < 0 || type >= NUM_TYPES || non_finite(x) || non_finite(y)) {
+            fprintf(stderr, "%s:%d: invalid particle\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        particles.x[i] = wrap_coordinate_exact(x, params.width);
+        particles.y[i] = wrap_coordinate_exact(y, params.height);
+        particles.type[i] = type;
+        reset_particle(i);
+        i++;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Places the particles from seed and resets the clock, so a run is fully
+// determined by (seed, params)
+void init_particles(unsigned seed) {
+    sim_seed = seed;
+    noise_key = rng_key(seed, RNG_NOISE, 0);
+    noise_pass = 0;
+    if(params.init == INIT_FILE) {
+        if(load_particles(params.load_path)) exit(1);
+    }
+    else {
+        particles_alloc(params.num_particles);
+        parallel_for(particles.count, place_range, NULL);
+    }
+    sim_time = 0;
+    step_count = 0;
+    last_dt = 0;
+    sleeping_fraction = 0;
+    previous_count = 0;
+
+    // The Verlet step starts from the forces at the initial positions
+    compute_forces();
+}
+
+// Parameters a sweep can vary. coefficient is applied by scaling the
+// species matrix by coefficient / COEFFICIENT, which gives the same forces
+// without turning the constant of the kernels into a variable.
+enum sweep_kind { SWEEP_COEFFICIENT, SWEEP_RADIUS_MIN, SWEEP_PARTICLES, SWEEP_SEED, SWEEP_MATRIX, NUM_SWEEP_KINDS };
+const char *sweep_kind_names[NUM_SWEEP_KINDS] = { "coefficient", "radius_min", "particles", "seed", "matrix" };
+
+// One swept parameter and its values
+typedef struct sweep_axis {
+    int kind;
+    int a, b;   // Species pair of a matrix entry, interaction[a][b]
+    int count;
+    double values[SWEEP_MAX_VALUES];
+} sweep_axis;
+
+// A sweep: job j takes value (j / stride) % count of every axis, the last
+// axis varying fastest
+typedef struct sweep_spec {
+    long steps;
+    int axes;
+    sweep_axis axis[SWEEP_MAX_AXES];
+    long jobs;
+} sweep_spec;
+
+// Reads a sweep spec, one parameter per line followed by its values, either
+// listed or as first:last:count (count evenly spaced values):
+//   steps 2000
+//   coefficient 0.0025 0.005 0.01
+//   radius_min 5:20:4         (core radius; params holds its square)
+//   particles 1000 4000
+//   seed 1 2 3
+//   matrix 0 1 -1e4 0 1e4     (interaction[0][1])
+// Everything else comes from the command line. Returns 1 on errors.
+int parse_sweep(const char *path, sweep_spec *spec) {
+    FILE *file = fopen(path, "r");
+    if(!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    spec->steps = SWEEP_STEPS;
+    spec->axes = 0;
+    char line[4096];
+    int line_number = 0;
+    while(fgets(line, sizeof line, file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if(comment) *comment = 0;
+        char *name = strtok(line, " \t\r\n");
+        if(!name) continue;
+        if(!strcmp(name, "steps")) {
+            char *value = strtok(NULL, " \t\r\n");
+            spec->steps = value ? atol(value) : 0;
+            if(spec->steps < 1) {
+                fprintf(stderr, "%s:%d: steps needs a positive count\n", path, line_number);
+                fclose(file);
+                return 1;
+            }
+            continue;
+        }
+
+        int kind = -1;
+        for(int k = 0; k < NUM_SWEEP_KINDS; k++) if(!strcmp(name, sweep_kind_names[k])) kind = k;
+        if(kind < 0 || spec->axes == SWEEP_MAX_AXES) {
+            fprintf(stderr, "%s:%d: %s %s\n", path, line_number, kind < 0 ? "unknown parameter" : "too many parameters", name);
+            fclose(file);
+            return 1;
+        }
+        sweep_axis *axis = &spec->axis[spec->axes++];
+        axis->kind = kind;
+        axis->a = axis->b = 0;
+        axis->count = 0;
+        if(kind == SWEEP_MATRIX) {
+            char *a = strtok(NULL, " \t\r\n"), *b = a ? strtok(NULL, " \t\r\n") : NULL;
+            axis->a = a ? atoi(a) : -1;
+            axis->b = b ? atoi(b) : -1;
+            if(axis->a < 0 || axis->a >= NUM_TYPES || axis->b < 0 || axis->b >= NUM_TYPES) {
+                fprintf(stderr, "%s:%d: matrix needs two species below %d\n", path, line_number, NUM_TYPES);
+                fclose(file);
+                return 1;
+            }
+        }
+        for(char *value = strtok(NULL, " \t\r\n"); value; value = strtok(NULL, " \t\r\n")) {
+            char *end;
+            double first = strtod(value, &end), last = first;
+            long count = 1;
+            if(*end == ':') {
+                last = strtod(end + 1, &end);
+                count = *end == ':' ? strtol(end + 1, &end, 10) : 0;
+            }
+            if(*end || count < 1 || axis->count + count > SWEEP_MAX_VALUES) {
+                fprintf(stderr, "%s:%d: invalid value %s\n", path, line_number, value);
+                fclose(file);
+                return 1;
+            }
+            for(long v = 0; v < count; v++) {
+                axis->values[axis->count++] = count > 1 ? first + (last - first) * v / (count - 1) : first;
+            }
+        }
+        if(!axis->count) {
+            fprintf(stderr, "%s:%d: %s has no values\n", path, line_number, name);
+            fclose(file);
+            return 1;
+        }
+    }
+    fclose(file);
+
+    spec->jobs = 1;
+    for(int x = 0; x < spec->axes; x++) {
+        spec->jobs *= spec->axis[x].count;
+        if(spec->jobs > 100000000) {
+            fprintf(stderr, "%s: more than 1e8 combinations\n", path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Value of axis x in job
+double sweep_value(const sweep_spec *spec, long job, int x) {
+    long stride = 1;
+    for(int y = x + 1; y < spec->axes; y++) stride *= spec->axis[y].count;
+    return spec->axis[x].values[job / stride % spec->axis[x].count];
+}
+
+// Writes the header of the results file into header: the job, the swept
+// parameters and the metrics sweep_run() reports
+void sweep_header(const sweep_spec *spec, char *header, int size) {
+    int length = snprintf(header, size, "job");
+    for(int x = 0; x < spec->axes && length < size; x++) {
+        const sweep_axis *axis = &spec->axis[x];
+        if(axis->kind == SWEEP_MATRIX) length += snprintf(header + length, size - length, ",m_%d_%d", axis->a, axis->b);
+        else length += snprintf(header + length, size - length, ",%s", sweep_kind_names[axis->kind]);
+    }
+    if(length < size) length += snprintf(header + length, size - length, ",steps,seconds,displacement");
+    for(int t = 0; t < NUM_TYPES && length < size; t++) length += snprintf(header + length, size - length, ",speed_%d", t);
+    if(length < size) snprintf(header + length, size - length, ",potential,clusters,largest,clustered\n");
+}
+
+// Writes the start of the row of job, up to and including the steps, into
+// row. A row of the results file with this prefix is the finished job.
+int sweep_key(const sweep_spec *spec, long job, char *row, int size) {
+    int length = snprintf(row, size, "%ld", job);
+    for(int x = 0; x < spec->axes && length < size; x++) length += snprintf(row + length, size - length, ",%.9g", sweep_value(spec, job, x));
+    if(length < size) length += snprintf(row + length, size - length, ",%ld,", spec->steps);
+    return length < size ? length : size - 1;
+}
+
+// Runs job in this process and writes its row to fd. Metrics of the final
+// state: total displacement of the last step, mean speed per species, the
+// potential, and the clusters of at least CLUSTER_MIN_SIZE particles (how
+// many, the largest and the share of the particles they hold).
+void sweep_run(const sweep_spec *spec, long job, int fd) {
+    unsigned seed = 42;
+    double coefficient = COEFFICIENT;
+    for(int x = 0; x < spec->axes; x++) {
+        const sweep_axis *axis = &spec->axis[x];
+        double value = sweep_value(spec, job, x);
+        if(axis->kind == SWEEP_COEFFICIENT) coefficient = value;
+        else if(axis->kind == SWEEP_RADIUS_MIN) params.radius_min_squared = value * value;
+        else if(axis->kind == SWEEP_PARTICLES) params.num_particles = (int)value;
+        else if(axis->kind == SWEEP_SEED) seed = (unsigned)value;
+        else interaction[axis->a][axis->b] = value;
+    }
+    for(int a = 0; a < NUM_TYPES; a++) {
+        for(int b = 0; b < NUM_TYPES; b++) interaction[a][b] *= coefficient / (COEFFICIENT);
+    }
+    params.diagnostics = params.rdf = params.clustering = params.tracking = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init_particles(seed);
+    for(long s = 1; s < spec->steps; s++) step();
+    diagnostics_begin();
+    step();
+    double potential = diagnostics_end();
+    detect_clusters();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    int largest = 0, clustered = 0;
+    for(int k = 0; k < cluster_count; k++) {
+        clustered += cluster_list[k].size;
+        if(cluster_list[k].size > largest) largest = cluster_list[k].size;
+    }
+    char row[4096];
+    int length = sweep_key(spec, job, row, sizeof row);
+    length += snprintf(row + length, sizeof row - length, "%.3f,%g", seconds, diag.displacement);
+    for(int t = 0; t < NUM_TYPES; t++) {
+        length += snprintf(row + length, sizeof row - length, ",%g", diag.count[t] ? diag.speed[t] / diag.count[t] : 0);
+    }
+    length += snprintf(row + length, sizeof row - length, ",%.9g,%d,%d,%g\n", potential, cluster_count, largest,
+                       particles.count ? (double)clustered / particles.count : 0);
+    if(write(fd, row, length) != length) _exit(1);
+}
+
+// One running job of a sweep: its process and the pipe its row arrives on
+typedef struct sweep_worker {
+    pid_t pid;
+    int fd;
+    long job;
+} sweep_worker;
+
+// Runs every job of the sweep in spec_path not yet in results_path, jobs at
+// a time, each in a forked process with the command line parameters (and
+// one thread, unless --threads says otherwise). Rows are appended as the
+// runs finish, so an interrupted sweep resumes where it stopped: finished
+// rows are kept, a partly written last row is dropped and run again.
+// Returns 1 if the sweep could not run or any job failed.
+int run_sweep(const char *spec_path, const char *results_path, int jobs) {
+    static sweep_spec spec;
+    if(parse_sweep(spec_path, &spec)) return 1;
+    if(jobs < 1) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobs < 1) jobs = 1;
+    if(jobs > MAX_THREADS) jobs = MAX_THREADS;
+    if(params.threads < 1) params.threads = 1;
+
+    // The header this spec writes, to tell its results from another sweep's
+    char header[4096];
+    sweep_header(&spec, header, sizeof header);
+
+    // Finished jobs: complete rows with the key of their job
+    char *done = calloc(spec.jobs, 1);
+    char temporary[4096];
+    snprintf(temporary, sizeof temporary, "%s.tmp", results_path);
+    FILE *kept = fopen(temporary, "w");
+    if(!done || !kept) {
+        fprintf(stderr, "Cannot create %s\n", temporary);
+        free(done);
+        return 1;
+    }
+    fputs(header, kept);
+    long finished = 0;
+    FILE *previous = fopen(results_path, "r");
+    if(previous) {
+        char row[4096], key[4096];
+        int first = 1;
+        while(fgets(row, sizeof row, previous)) {
+            if(first && strcmp(row, header)) {
+                fprintf(stderr, "%s holds the results of another sweep\n", results_path);
+                fclose(previous);
+                fclose(kept);
+                remove(temporary);
+                free(done);
+                return 1;
+            }
+            long job = atol(row);
+            size_t length = strlen(row);
+            if(first || job < 0 || job >= spec.jobs || done[job] || !length || row[length - 1] != '\n') {
+                first = 0;
+                continue;
+            }
+            int key_length = sweep_key(&spec, job, key, sizeof key);
+            if(strncmp(row, key, key_length)) continue;
+            done[job] = 1;
+            finished++;
+            fputs(row, kept);
+        }
+        fclose(previous);
+    }
+    if(fclose(kept) || rename(temporary, results_path)) {
+        fprintf(stderr, "Cannot write %s\n", results_path);
+        free(done);
+        return 1;
+    }
+    FILE *results = fopen(results_path, "a");
+    if(!results) {
+        fprintf(stderr, "Cannot write %s\n", results_path);
+        free(done);
+        return 1;
+    }
+
+    // Job queue: the next unfinished job goes to the first free worker
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sweep_worker workers[MAX_THREADS];
+    int running = 0;
+    long next = 0, completed = 0, failed = 0;
+    fflush(stdout);
+    while(1) {
+        while(next < spec.jobs && done[next]) next++;
+        if(running < jobs && next < spec.jobs) {
+            int pipe_fds[2];
+            if(pipe(pipe_fds)) {
+                fprintf(stderr, "Cannot create a pipe for job %ld\n", next);
+                failed += spec.jobs - next;
+                next = spec.jobs;
+                continue;
+            }
+            pid_t pid = fork();
+            if(pid == 0) {
+                close(pipe_fds[0]);
+                sweep_run(&spec, next, pipe_fds[1]);
+                _exit(0);
+            }
+            close(pipe_fds[1]);
+            if(pid < 0) {
+                close(pipe_fds[0]);
+                fprintf(stderr, "Cannot start job %ld\n", next);
+                failed++;
+            }
+            else workers[running++] = (sweep_worker){ pid, pipe_fds[0], next };
+            next++;
+            continue;
+        }
+        if(!running) break;
+
+        // A row is short enough for the pipe buffer, so the worker never
+        // blocks on it and can be reaped before it is read
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        int w = 0;
+        while(w < running && workers[w].pid != pid) w++;
+        if(w == running) continue;
+        char row[4096];
+        long length = 0, got;
+        while(length < (long)sizeof row - 1 && (got = read(workers[w].fd, row + length, sizeof row - 1 - length)) > 0) length += got;
+        row[length] = 0;
+        close(workers[w].fd);
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0 && length && row[length - 1] == '\n') {
+            fputs(row, results);
+            fflush(results);
+            completed++;
+        }
+        else {
+            fprintf(stderr, "Job %ld failed\n", workers[w].job);
+            failed++;
+        }
+        workers[w] = workers[--running];
+    }
+    fclose(results);
+    free(done);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("sweep: %ld job(s), %ld already done, %ld run in %.3f s with %d worker(s), %ld failed\n",
+           spec.jobs, finished, completed, seconds, jobs, failed);
+    return failed ? 1 : 0;
+}
+
+// Golden snapshots for --verify, generated with --golden. Regenerate them
+// only for an intended change of the physics, never to make a kernel pass.
+const golden_case golden_cases[] = {
+    { ENGINE_SCALAR, 0, 42, 0.001f,
+      { 426.10437f, 698.848083f, 139.731537f, 961.684692f, 717.437866f, 498.142456f, 533.109863f, 607.137207f, },
+      { 766.00592f, 897.396118f, 980.45636f, 77.2816925f, 841.09021f, 189.235504f, 60.5360603f, 883.20697f, } },
+    { ENGINE_SCALAR, 1, 7, 0.001f,
+      { 71.8346786f, 658.361328f, 722.285522f, 302.28656f, 443.307098f, 591.656006f, 877.780029f, 249.445953f, },
+      { 961.847778f, 805.042114f, 505.505188f, 97.4158173f, 810.361084f, 736.912354f, 266.138275f, 257.740997f, } },
+    { ENGINE_SIMD, 0, 42, 0.001f,
+      { 426.10437f, 698.848083f, 139.731537f, 961.684753f, 717.437866f, 498.142456f, 533.109863f, 607.137207f, },
+      { 766.00592f, 897.396118f, 980.45636f, 77.2816696f, 841.09021f, 189.235504f, 60.5360603f, 883.20697f, } },
+    { ENGINE_SIMD, 1, 7, 0.001f,
+      { 71.8346786f, 658.361328f, 722.285522f, 302.28656f, 443.307098f, 591.656006f, 877.780029f, 249.445923f, },
+      { 961.847778f, 805.042114f, 505.505188f, 97.4158173f, 810.361084f, 736.912354f, 266.138275f, 257.740997f, } },
+    { ENGINE_THREADED, 0, 42, 0.001f,
+      { 426.10437f, 698.848083f, 139.731537f, 961.684753f, 717.437866f, 498.142456f, 533.109863f, 607.137207f, },
+      { 766.00592f, 897.396118f, 980.45636f, 77.2816696f, 841.09021f, 189.235504f, 60.5360603f, 883.20697f, } },
+    { ENGINE_THREADED, 1, 7, 0.001f,
+      { 71.8346786f, 658.361328f, 722.285522f, 302.28656f, 443.307098f, 591.656006f, 877.780029f, 249.445923f, },
+      { 961.847778f, 805.042114f, 505.505188f, 97.4158173f, 810.361084f, 736.912354f, 266.138275f, 257.740997f, } },
+    { ENGINE_CELLS, 0, 42, 0.01f,
+      { 426.057709f, 699.872192f, 139.384079f, 961.481079f, 719.498108f, 499.142365f, 532.703796f, 607.989563f, },
+      { 766.400879f, 897.765137f, 979.544434f, 76.6958084f, 841.946838f, 188.964951f, 61.4669724f, 881.755371f, } },
+    { ENGINE_CELLS, 1, 7, 0.01f,
+      { 72.5597458f, 657.612488f, 723.529297f, 301.894257f, 448.085358f, 591.604431f, 877.457947f, 252.175171f, },
+      { 961.712036f, 805.308655f, 508.533936f, 95.3690033f, 810.766968f, 739.377441f, 267.687744f, 257.903931f, } },
+};
+
+// Accepted golden error per engine in pixels. The all-pairs kernels sum in
+// a fixed order, so only FMA contraction differs between builds; the cell
+// engine's cutoff adds a force step that amplifies such differences.
+const float golden_tolerance[NUM_ENGINES] = { 1e-3f, 1e-3f, 1e-3f, 1e-2f };
+
+// Runs one golden configuration from default parameters (keeping the
+// thread count, which must not change the results)
+void run_golden(int engine, int inertial, unsigned seed) {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.engine = engine;
+    params.inertial = inertial;
+    init_particles(seed);
+    for(int s = 0; s < GOLDEN_STEPS; s++) step();
+}
+
+// Current index of the particle created as index id (the cell sort moves
+// particles around)
+int particle_with_id(int id) {
+    for(int i = 0; i < particles.count; i++) if(particles.id[i] == id) return i;
+    return -1;
+}
+
+// Prints golden_cases for the current build, in the form used above
+int print_golden() {
+    unsigned seeds[2] = { 42, 7 };
+    for(int engine = 0; engine < NUM_ENGINES; engine++) {
+        for(int inertial = 0; inertial < 2; inertial++) {
+            char name[16];
+            int n = 0;
+            for(; engine_names[engine][n] && n < 15; n++) name[n] = toupper((unsigned char)engine_names[engine][n]);
+            name[n] = 0;
+
+            run_golden(engine, inertial, seeds[inertial]);
+            printf("    { ENGINE_%s, %d, %u, %gf,\n      {", name, inertial, seeds[inertial], golden_tolerance[engine]);
+            for(int k = 0; k < GOLDEN_SAMPLES; k++) printf(" %.9gf,", particles.x[particle_with_id(k * particles.count / GOLDEN_SAMPLES)]);
+            printf(" },\n      {");
+            for(int k = 0; k < GOLDEN_SAMPLES; k++) printf(" %.9gf,", particles.y[particle_with_id(k * particles.count / GOLDEN_SAMPLES)]);
+            printf(" } },\n");
+        }
+    }
+    return 0;
+}
+
+// Checks wrap_coordinate() on multi-period jumps, rounding edges and
+// non-square domains, wrap_coordinate_exact() and wrap_positions() also on
+// values far beyond WRAP_PERIODS; returns the number of failures
+int verify_wrap() {
+    float values[] = { -3500.5f, -1000.0f, -1e-6f, 0.0f, 999.99994f, 1000.0f, 5001.0f, 12345.678f, -123456.5f,
+                       4.0961e6f, -2.5e10f, 1e30f, -3e38f };
+    float periods[] = { 1000.0f, 640.0f, 360.0f, 333.3f, 0.5f };
+    int failures = 0;
+
+    for(unsigned p = 0; p < sizeof periods / sizeof *periods; p++) {
+        for(unsigned v = 0; v < sizeof values / sizeof *values; v++) {
+            for(int exact = 0; exact < 2; exact++) {
+                if(!exact && fabsf(values[v]) >= WRAP_PERIODS * periods[p]) continue;
+                float w = exact ? wrap_coordinate_exact(values[v], periods[p]) : wrap_coordinate(values[v], periods[p]);
+                // Inside the domain, and the same point modulo the period
+                float shift = (values[v] - w) / periods[p];
+                if(!(w >= 0.0f && w < periods[p]) || fabsf(shift - rintf(shift)) > 1e-3f) {
+                    printf("FAIL wrap%s %g in period %g -> %g\n", exact ? " exact" : "", values[v], periods[p], w);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    // A far-out position takes the scalar pass of wrap_positions()
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.num_particles = 64;
+    init_particles(5);
+    particles.x[3] = 1e30f;
+    particles.y[40] = -2.5e10f;
+    wrap_positions();
+    for(int i = 0; i < particles.count; i++) {
+        if(!(particles.x[i] >= 0.0f && particles.x[i] < params.width && particles.y[i] >= 0.0f &&
+             particles.y[i] < params.height)) {
+            printf("FAIL wrap positions: particle %d at %g %g\n", i, particles.x[i], particles.y[i]);
+            failures++;
+        }
+    }
+    if(!failures) printf("PASS wrap\n");
+    return failures;
+}
+
+// Checks the repair of a corrupted particle with every engine: with NaN in
+// the position and velocity of one particle, the next step must complete,
+// respawn it with finite state and log exactly one repair. Returns the
+// number of failures.
+int verify_repair() {
+    int threads = params.threads;
+    int failures = 0;
+    for(int e = 0; e < NUM_ENGINES; e++) {
+        params = default_params;
+        params.threads = threads;
+        params.engine = e;
+        params.validate = 1;
+        params.num_particles = 500;
+        init_particles(19);
+        step();
+        int i = particle_with_id(7);
+        particles.x[i] = particles.y[i] = NAN;
+        particles.vx[i] = particles.vy[i] = NAN;
+        long repairs = sanitize_count;
+        step();
+
+        int bad = 0;
+        for(int j = 0; j < particles.count; j++) {
+            bad += non_finite(particles.x[j]) || non_finite(particles.y[j]) || non_finite(particles.vx[j]) ||
+                   non_finite(particles.vy[j]) || non_finite(particles.fx[j]) || non_finite(particles.fy[j]);
+        }
+        int logged = sanitize_log[repairs % MAX_SANITIZE_EVENTS].particle;
+        int pass = !bad && step_count == 2 && sanitize_count - repairs == 1 && logged == 7;
+        printf("%s repair %s: %ld repair(s) logged for particle %d, %d non-finite particle(s)\n", pass ? "PASS" : "FAIL",
+               engine_names[e], sanitize_count - repairs, logged, bad);
+        failures += !pass;
+    }
+    params.threads = threads;
+    return failures;
+}
+
+// Runs steps block steps of 4 levels with engine on a clustered world and
+// leaves the positions in x and y, by particle id
+void run_block(int engine, int steps, float *x, float *y) {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads > 1 ? threads : 3;
+    params.engine = engine;
+    params.block_levels = 4;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 1000;
+    init_particles(23);
+    for(int s = 0; s < steps; s++) step();
+    for(int i = 0; i < particles.count; i++) {
+        x[particles.id[i]] = particles.x[i];
+        y[particles.id[i]] = particles.y[i];
+    }
+    params.threads = threads;
+}
+
+// Checks the time step control. Adaptive: every step stays in [dt_min,
+// dt_max] and moves no particle further than max_displacement unless dt_min
+// forced it. Blocks: a single level reproduces the overdamped integrator
+// with dt = dt_max bit for bit, and the threaded engine's parallel block
+// forces match the serial simd ones exactly. Returns the number of failures.
+int verify_timestep() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.adaptive = 1;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 1000;
+    init_particles(21);
+    float *x = malloc(sizeof(float) * particles.count);
+    float *y = malloc(sizeof(float) * particles.count);
+    if(!x || !y) {
+        fprintf(stderr, "Cannot allocate %d positions\n", particles.count);
+        exit(1);
+    }
+    int violations = 0;
+    float smallest = INFINITY, largest = 0;
+    for(int s = 0; s < 50; s++) {
+        memcpy(x, particles.x, sizeof(float) * particles.count);
+        memcpy(y, particles.y, sizeof(float) * particles.count);
+        step();
+        smallest = fminf(smallest, last_dt);
+        largest = fmaxf(largest, last_dt);
+        if(last_dt < params.dt_min || last_dt > params.dt_max) violations++;
+        if(last_dt == params.dt_min) continue;
+        for(int i = 0; i < particles.count; i++) {
+            float dx = min_image(particles.x[i] - x[i], params.width);
+            float dy = min_image(particles.y[i] - y[i], params.height);
+            violations += sqrtf(dx * dx + dy * dy) > params.max_displacement * 1.001f;
+        }
+    }
+    int pass = !violations && smallest < largest;
+    printf("%s adaptive steps: dt in [%g, %g], %d violation(s)\n", pass ? "PASS" : "FAIL", smallest, largest, violations);
+    int failures = !pass;
+    free(x);
+    free(y);
+
+    // One level: the same arithmetic as an overdamped step of dt_max
+    params = default_params;
+    params.threads = threads;
+    params.block_levels = 1;
+    params.num_particles = 1000;
+    init_particles(22);
+    for(int s = 0; s < 20; s++) step();
+    int count = particles.count;
+    float *block_x = malloc(sizeof(float) * count);
+    float *block_y = malloc(sizeof(float) * count);
+    float *other_x = malloc(sizeof(float) * count);
+    float *other_y = malloc(sizeof(float) * count);
+    if(!block_x || !block_y || !other_x || !other_y) {
+        fprintf(stderr, "Cannot allocate %d positions\n", count);
+        exit(1);
+    }
+    memcpy(block_x, particles.x, sizeof(float) * count);
+    memcpy(block_y, particles.y, sizeof(float) * count);
+    params.block_levels = 0;
+    params.dt = params.dt_max;
+    init_particles(22);
+    for(int s = 0; s < 20; s++) step();
+    int single = 0;
+    for(int i = 0; i < count; i++) single += block_x[i] != particles.x[i] || block_y[i] != particles.y[i];
+
+    // Four levels, serial simd against the threaded engine
+    run_block(ENGINE_SIMD, 10, block_x, block_y);
+    run_block(ENGINE_THREADED, 10, other_x, other_y);
+    int threaded = 0;
+    for(int i = 0; i < count; i++) threaded += block_x[i] != other_x[i] || block_y[i] != other_y[i] || non_finite(other_x[i]);
+    free(block_x);
+    free(block_y);
+    free(other_x);
+    free(other_y);
+
+    pass = !single && !threaded;
+    printf("%s block steps: %d particle(s) off the overdamped step, %d off the serial engine\n", pass ? "PASS" : "FAIL",
+           single, threaded);
+    params.threads = threads;
+    return failures + !pass;
+}
+
+// Checks every specialised kernel against the generic one on its own domain
+// size; both do the same float operations, so the forces must agree exactly.
+// Returns the number of failures.
+int verify_kernels() {
+    int threads = params.threads;
+    int failures = 0;
+    for(unsigned v = 0; v < sizeof kernel_variants / sizeof *kernel_variants; v++) {
+        const kernel_variant *variant = &kernel_variants[v];
+        params = default_params;
+        params.threads = threads;
+        params.width = variant->width;
+        params.height = variant->height;
+        params.num_particles = 1000;
+        params.engine = ENGINE_CELLS;   // So prepare_forces() also builds the grid
+        params.cell_update = CELLS_SPECIES;   // Which every cells kernel can use
+        init_particles(1);
+
+        const force_fn pair[4][2] = { { compute_force_simd, variant->simd }, { compute_force_cells, variant->cells },
+                                      { compute_force_cells_sorted, variant->cells_sorted },
+                                      { compute_force_cells_species, variant->cells_species } };
+        const char *names[4] = { "simd", "cells", "sorted cells", "species cells" };
+        for(int engine = 0; engine < 4; engine++) {
+            int mismatches = 0;
+            for(int i = 0; i < particles.count; i++) {
+                pair[engine][0](i);
+                float fx = particles.fx[i], fy = particles.fy[i];
+                pair[engine][1](i);
+                mismatches += fx != particles.fx[i] || fy != particles.fy[i];
+            }
+            printf("%s %s kernel %s: %d mismatched force(s)\n", mismatches ? "FAIL" : "PASS",
+                   names[engine], variant->name, mismatches);
+            failures += mismatches > 0;
+        }
+    }
+    return failures;
+}
+
+// Checks the parallel cell sorts with several threads: particles must be
+// ordered by cell (and species, for the species sort), stable (with equal
+// keys in their order before the sort), still a permutation of the ids, and
+// the contiguous kernels must agree with the indirect one up to the rounding
+// of their different summation order. Returns the number of failures.
+int verify_sort() {
+    int threads = params.threads;
+    int failures = 0;
+    for(int mode = CELLS_SORTED; mode <= CELLS_SPECIES; mode++) {
+        params = default_params;
+        params.threads = threads > 1 ? threads : 3;
+        params.engine = ENGINE_CELLS;
+        params.cell_update = mode;
+        params.num_particles = 5000;
+        params.width = params.height = 2000;
+        init_particles(11);
+        for(int s = 0; s < 20; s++) step();
+
+        // Index of every id before the sort, -1 once seen after it
+        int *before = malloc(sizeof(int) * particles.count);
+        if(!before) {
+            fprintf(stderr, "Cannot allocate %d indices\n", particles.count);
+            exit(1);
+        }
+        for(int i = 0; i < particles.count; i++) before[particles.id[i]] = i;
+        prepare_forces();
+
+        int species = mode == CELLS_SPECIES ? NUM_TYPES : 1;
+        int disorder = 0, previous = -1;
+        long previous_key = -1;
+        for(int i = 0; i < particles.count; i++) {
+            int id = particles.id[i];
+            int c = grid.particle_cell[i];
+            long key = (long)c * species + (species > 1 ? particles.type[i] : 0);
+            if(id < 0 || id >= particles.count || before[id] < 0) {
+                disorder++;
+                continue;
+            }
+            disorder += i < grid.cell_start[c] || i >= grid.cell_end[c];
+            if(species > 1) disorder += i < grid.species_start[key] || i >= grid.species_start[key + 1];
+            disorder += key < previous_key || (key == previous_key && before[id] < previous);
+            previous_key = key;
+            previous = before[id];
+            before[id] = -1;
+        }
+        free(before);
+
+        force_fn contiguous = species > 1 ? compute_force_cells_species : compute_force_cells_sorted;
+        float error = 0;
+        for(int i = 0; i < particles.count; i++) {
+            compute_force_cells(i);
+            float fx = particles.fx[i], fy = particles.fy[i];
+            contiguous(i);
+            float d = fabsf(fx - particles.fx[i]) + fabsf(fy - particles.fy[i]);
+            float scale = 1e-4f * (fabsf(fx) + fabsf(fy)) + 1e-6f;
+            error = fmaxf(error, d / scale);
+        }
+
+        int pass = !disorder && error <= 1;
+        printf("%s %s cell sort (%d threads): %d misplaced particle(s), kernel error %g of tolerance\n",
+               pass ? "PASS" : "FAIL", cell_update_names[mode], thread_count(), disorder, error);
+        failures += !pass;
+    }
+    params.threads = threads;
+    return failures;
+}
+
+// Measures the summation error of the simd kernel under the ACCUMULATE
+// policy on a large clustered world, where big opposing forces cancel: the
+// reference adds the same float pair forces in double. Fails when the rms
+// error exceeds 1e-3 of the rms force. Returns the number of failures.
+int verify_precision() {
+    const char *policies[3] = { "float", "double", "compensated" };
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 20000;
+    params.width = params.height = 4000;
+    init_particles(5);
+    prepare_forces();
+
+    double error = 0, magnitude = 0;
+    int samples = 0;
+    for(int i = 0; i < particles.count; i += particles.count / 256, samples++) {
+        double ref_x = 0, ref_y = 0;
+        for(int j = 0; j < particles.count; j++) {
+            float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+            float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+            float fx, fy;
+            pair_force(x_pos, y_pos, species_coef[particles.type[i]][j], &fx, &fy);
+            ref_x += fx;
+            ref_y += fy;
+        }
+        compute_force_simd(i);
+        error += (particles.fx[i] - ref_x) * (particles.fx[i] - ref_x) + (particles.fy[i] - ref_y) * (particles.fy[i] - ref_y);
+        magnitude += ref_x * ref_x + ref_y * ref_y;
+    }
+
+    double relative = sqrt(error / magnitude);
+    int pass = relative <= 1e-3;
+    printf("%s %s accumulation: rms error %g of the rms force over %d particles\n", pass ? "PASS" : "FAIL",
+           policies[ACCUMULATE], relative, samples);
+    return !pass;
+}
+
+// Checks the diagnostics pair potential against the force: minus its
+// central difference along x and y at a few particles must match the
+// scalar kernel's force to within 0.1% of the force scale. Returns the
+// number of failures.
+int verify_diagnostics() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.engine = ENGINE_SCALAR;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 300;
+    params.width = params.height = 1000;
+    init_particles(9);
+    for(int s = 0; s < 20; s++) step();
+    prepare_forces();
+
+    const float h = 0.05f;
+    float error = 0, scale = 0;
+    for(int i = 0; i < particles.count; i += particles.count / 10) {
+        compute_force_scalar(i);
+        float force[2] = { particles.fx[i], particles.fy[i] };
+        float *position[2] = { &particles.x[i], &particles.y[i] };
+        for(int axis = 0; axis < 2; axis++) {
+            float saved = *position[axis];
+            *position[axis] = saved + h;
+            double plus = particle_potential(i);
+            *position[axis] = saved - h;
+            double minus = particle_potential(i);
+            *position[axis] = saved;
+            error = fmaxf(error, fabsf(force[axis] + (float)((plus - minus) / (2 * h))));
+            scale = fmaxf(scale, fabsf(force[axis]));
+        }
+    }
+
+    int pass = error <= 1e-3f * scale;
+    printf("%s pair potential: max gradient error %g for forces up to %g\n", pass ? "PASS" : "FAIL", error, scale);
+    return !pass;
+}
+
+// Checks the potential the force kernels sum on record steps against
+// particle_potential() for every engine and cell update, to within 1e-5 of
+// the summed magnitudes, and that the forces of the pass match a plain one
+// (up to rounding: the compiler may contract the two kernel variants into
+// fused multiply-adds differently). Returns the number of failures.
+int verify_fused_potential() {
+    int threads = params.threads;
+    int failures = 0;
+    for(int e = 0; e < NUM_ENGINES; e++) {
+        for(int u = 0; u < (e == ENGINE_CELLS ? NUM_CELL_UPDATES : 1); u++) {
+            params = default_params;
+            params.threads = threads;
+            params.engine = e;
+            params.cell_update = u;
+            params.init = INIT_CLUSTERED;
+            params.num_particles = e == ENGINE_SCALAR ? 300 : 1500;
+            init_particles(9);
+            for(int s = 0; s < 20; s++) step();
+
+            diagnostics_begin();
+            compute_forces();
+            double fused = diagnostics_end();
+            float *fx = malloc(sizeof(float) * particles.count);
+            float *fy = malloc(sizeof(float) * particles.count);
+            if(!fx || !fy) {
+                fprintf(stderr, "Cannot allocate %d forces\n", particles.count);
+                exit(1);
+            }
+            memcpy(fx, particles.fx, sizeof(float) * particles.count);
+            memcpy(fy, particles.fy, sizeof(float) * particles.count);
+            compute_forces();
+            double reference = 0, scale = 0;
+            float force_error = 0, force_scale = 0;
+            for(int i = 0; i < particles.count; i++) {
+                double p = particle_potential(i);
+                reference += 0.5 * p;
+                scale += 0.5 * fabs(p);
+                force_error = fmaxf(force_error, fmaxf(fabsf(fx[i] - particles.fx[i]), fabsf(fy[i] - particles.fy[i])));
+                force_scale = fmaxf(force_scale, fmaxf(fabsf(particles.fx[i]), fabsf(particles.fy[i])));
+            }
+            free(fx);
+            free(fy);
+
+            int pass = fabs(fused - reference) <= 1e-5 * scale && force_error <= 1e-6f * force_scale;
+            printf("%s fused potential %s%s%s: %.9g, %.9g separately, force error %g\n", pass ? "PASS" : "FAIL",
+                   engine_names[e], e == ENGINE_CELLS ? " " : "", e == ENGINE_CELLS ? cell_update_names[u] : "",
+                   fused, reference, force_error);
+            failures += !pass;
+        }
+    }
+    params.threads = threads;
+    return failures;
+}
+
+// Checks the streaming g(r) on an uncorrelated uniform placement, where
+// every species pair must average 1 within 3% beyond the core radius, and
+// that a sample with several threads counts exactly the same pairs as a
+// serial one. Returns the number of failures.
+int verify_rdf() {
+    int threads = params.threads;
+    params = default_params;
+    params.num_particles = 6000;
+    params.width = params.height = 2000;
+    init_particles(13);
+
+    params.threads = 1;
+    rdf_reset();
+    rdf_sample();
+    double serial[NUM_PAIRS][RDF_BINS];
+    memcpy(serial, rdf.total, sizeof serial);
+    params.threads = threads > 1 ? threads : 3;
+    rdf_reset();
+    rdf_sample();
+    int mismatches = memcmp(serial, rdf.total, sizeof serial) != 0;
+
+    double worst = 0;
+    int first = (int)ceilf(sqrtf(params.radius_min_squared) / rdf.range * RDF_BINS);
+    for(int p = 0; p < NUM_PAIRS; p++) {
+        double mean = 0;
+        for(int b = first; b < RDF_BINS; b++) mean += rdf_value(p, b) / (RDF_BINS - first);
+        worst = fmax(worst, fabs(mean - 1));
+    }
+
+    int pass = !mismatches && worst <= 0.03;
+    printf("%s g(r) (%d threads): uniform placement within %g of 1, %s thread count\n", pass ? "PASS" : "FAIL",
+           thread_count(), worst, mismatches ? "depends on the" : "independent of the");
+    params.threads = threads;
+    return !pass;
+}
+
+// Checks the parallel cluster detection with several threads against a
+// serial all-pairs union-find on a clustered world: every particle must
+// end up with the same root (the smallest index of its cluster) and the
+// reported sizes must add up. Returns the number of failures.
+int verify_clusters() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads > 1 ? threads : 3;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 2000;
+    init_particles(17);
+    for(int s = 0; s < 100; s++) step();
+    detect_clusters();
+
+    int *parent = malloc(sizeof(int) * particles.count);
+    if(!parent) {
+        fprintf(stderr, "Cannot allocate %d roots\n", particles.count);
+        exit(1);
+    }
+    for(int i = 0; i < particles.count; i++) parent[i] = i;
+    for(int i = 0; i < particles.count; i++) {
+        for(int j = i + 1; j < particles.count; j++) {
+            float x_pos = min_image(particles.x[i] - particles.x[j], params.width);
+            float y_pos = min_image(particles.y[i] - particles.y[j], params.height);
+            if(x_pos * x_pos + y_pos * y_pos >= CLUSTER_LINK * CLUSTER_LINK) continue;
+            int a = find_root(parent, i), b = find_root(parent, j);
+            parent[a > b ? a : b] = a > b ? b : a;
+        }
+    }
+    int mismatches = 0;
+    for(int i = 0; i < particles.count; i++) mismatches += find_root(parent, i) != cluster_parent[i];
+    free(parent);
+
+    long members = 0, labelled = 0;
+    for(int k = 0; k < cluster_count; k++) members += cluster_list[k].size;
+    for(int i = 0; i < particles.count; i++) labelled += cluster_label[i] >= 0;
+
+    int pass = !mismatches && members == labelled && cluster_count > 0;
+    printf("%s clusters (%d threads): %d cluster(s) of %ld particles, %d misassigned particle(s)\n",
+           pass ? "PASS" : "FAIL", thread_count(), cluster_count, members, mismatches);
+    params.threads = threads;
+    return !pass;
+}
+
+// Places count particles from id first on in a compact block, four per row
+// 5 apart, at (x, y)
+void place_block(int first, int count, float x, float y) {
+    for(int n = 0; n < count; n++) {
+        int i = particle_with_id(first + n);
+        particles.x[i] = x + 5 * (n % 4);
+        particles.y[i] = y + 5 * (n / 4);
+    }
+}
+
+// Places particles from id first on as singletons 30 apart along the top
+void place_scattered(int first, int count) {
+    for(int n = 0; n < count; n++) {
+        int i = particle_with_id(first + n);
+        particles.x[i] = 10 + 30 * (n % 32);
+        particles.y[i] = 900 + 40 * (n / 32);
+    }
+}
+
+// Cell sort and detection of a tracking step, as step() sorts them for the
+// sorted cell engine: particle indices no longer match their ids, so the
+// tracking has to follow the ids. Returns whether the sort moved any.
+int sorted_detection() {
+    sort_cells(&grid, params.cutoff, 0);
+    detect_clusters();
+    track_clusters();
+    for(int i = 0; i < particles.count; i++) if(particles.id[i] != i) return 1;
+    return 0;
+}
+
+// Checks the cluster tracking on hand placed blocks of 16 particles over
+// three detections: A moves by 10 and keeps its track with a velocity of
+// 10, B splits in two, C and D merge, E condenses from singletons and A
+// then dissolves. Runs on the sorted cell engine, which reorders the
+// particles between detections. Returns the number of failures.
+int verify_tracking() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.engine = ENGINE_CELLS;
+    params.cell_update = CELLS_SORTED;
+    params.num_particles = 80;
+    params.width = params.height = 1000;
+    init_particles(5);
+    long events[4];
+    memcpy(events, track_events, sizeof(events));
+
+    place_block(0, 16, 100, 100);
+    place_block(16, 16, 500, 500);
+    place_block(32, 16, 800, 200);
+    place_block(48, 16, 800, 400);
+    place_scattered(64, 16);
+    int sorted = sorted_detection();
+    long track_a = cluster_list[cluster_label[particle_with_id(0)]].track;
+
+    sim_time = 1;
+    place_block(0, 16, 110, 100);
+    place_block(16, 8, 500, 500);
+    place_block(24, 8, 300, 700);
+    place_block(32, 32, 800, 300);
+    place_block(64, 16, 200, 800);
+    sorted &= sorted_detection();
+    const cluster *a = &cluster_list[cluster_label[particle_with_id(0)]];
+    int moved = a->track == track_a && fabsf(a->vx - 10) < 1e-3f && fabsf(a->vy) < 1e-3f && a->born == 0;
+
+    sim_time = 2;
+    place_scattered(0, 16);
+    sorted &= sorted_detection();
+
+    long counted[4];
+    for(int e = 0; e < 4; e++) counted[e] = track_events[e] - events[e];
+    int pass = sorted && moved && counted[TRACK_BIRTH] == 5 && counted[TRACK_DEATH] == 1 && counted[TRACK_SPLIT] == 1 &&
+               counted[TRACK_MERGE] == 1 && cluster_count == 4;
+    printf("%s tracking: %ld birth(s), %ld death(s), %ld split(s), %ld merge(s), velocity %s, %s\n",
+           pass ? "PASS" : "FAIL", counted[TRACK_BIRTH], counted[TRACK_DEATH], counted[TRACK_SPLIT],
+           counted[TRACK_MERGE], moved ? "kept" : "wrong", sorted ? "reordered" : "never reordered");
+    return !pass;
+}
+
+// Reads the rows of a sweep results file into rows by job, from the column
+// after seconds on (the rest of a row does not depend on timing). Returns
+// the number of rows read.
+int sweep_rows(const char *path, int columns, char rows[][512], int count) {
+    FILE *file = fopen(path, "r");
+    if(!file) return 0;
+    char line[512];
+    int read = 0;
+    while(fgets(line, sizeof line, file)) {
+        long job = atol(line);
+        if(line[0] == 'j' || job < 0 || job >= count) continue;
+        char *metrics = line;
+        for(int c = 0; c < columns && metrics; c++) {
+            metrics = strchr(metrics, ',');
+            if(metrics) metrics++;
+        }
+        if(!metrics) continue;
+        strcpy(rows[job], metrics);
+        read++;
+    }
+    fclose(file);
+    return read;
+}
+
+// Checks a small sweep and its resumption: interrupted after one row and
+// part of the next, the rerun must run the three missing jobs only and
+// produce the same rows. Returns the number of failures.
+int verify_sweep() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = 1;
+    char spec_path[64], results_path[64];
+    snprintf(spec_path, sizeof spec_path, "/tmp/life-verify-%d.sweep", (int)getpid());
+    snprintf(results_path, sizeof results_path, "/tmp/life-verify-%d.csv", (int)getpid());
+    FILE *spec = fopen(spec_path, "w");
+    if(!spec) {
+        fprintf(stderr, "Cannot create %s\n", spec_path);
+        exit(1);
+    }
+    fprintf(spec, "steps 20\nparticles 200\nseed 1 2\ncoefficient 0.005 0.01\n");
+    fclose(spec);
+
+    // Columns up to seconds: job, particles, seed, coefficient, steps, seconds
+    static char complete[4][512], resumed[4][512];
+    remove(results_path);
+    int failed = run_sweep(spec_path, results_path, 2);
+    int first = sweep_rows(results_path, 6, complete, 4);
+
+    // Interrupt it: the header, one row and the start of another
+    FILE *results = fopen(results_path, "r");
+    char header[512], row[512], partial[512];
+    int rows = results && fgets(header, sizeof header, results) && fgets(row, sizeof row, results) &&
+               fgets(partial, sizeof partial, results);
+    if(results) fclose(results);
+    results = fopen(results_path, "w");
+    if(results) {
+        if(rows) fprintf(results, "%s%s%.10s", header, row, partial);
+        fclose(results);
+    }
+    failed += run_sweep(spec_path, results_path, 2);
+    int second = sweep_rows(results_path, 6, resumed, 4);
+    remove(spec_path);
+    remove(results_path);
+
+    int same = 1;
+    for(int j = 0; j < 4; j++) same &= !strcmp(complete[j], resumed[j]);
+
+    // radius_min is swept as the core radius; params holds its square
+    sweep_spec radius = { .steps = 1, .axes = 1, .jobs = 1 };
+    radius.axis[0] = (sweep_axis){ .kind = SWEEP_RADIUS_MIN, .count = 1, .values = { 5 } };
+    int null = open("/dev/null", O_WRONLY);
+    params.num_particles = 100;
+    if(null >= 0) sweep_run(&radius, 0, null);
+    if(null >= 0) close(null);
+    int squared = params.radius_min_squared == 25.0f;
 
-particle particles[NUM_PARTICLES];
+    int pass = !failed && rows && first == 4 && second == 4 && same && squared;
+    printf("%s sweep: %d + %d row(s), resumed rows %s, radius_min %s\n", pass ? "PASS" : "FAIL", first, second,
+           same ? "identical" : "differ", squared ? "squared" : "not squared");
+    params.threads = threads;
+    return !pass;
+}
+
+// Checks the live export through a second, read-only mapping: the newest
+// frame must match the particles after the initial publish and after a
+// step, the other buffer must still hold the frame before, a buffer the
+// writer is in the middle of must not be returned, and closing must flag
+// the segment and remove its name. Returns the number of failures.
+int verify_export() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.num_particles = 1000;
+    char name[64];
+    snprintf(name, sizeof name, "/life-verify-%d", (int)getpid());
+    params.export_name = name;
+    init_particles(11);
+    if(export_open()) return 1;
+    size_t bytes;
+    const export_header *h = export_attach(name, &bytes);
+    float *x = malloc(sizeof(float) * particles.count);
+    float *y = malloc(sizeof(float) * particles.count);
+    int32_t *type = malloc(sizeof(int32_t) * particles.count);
+    int32_t *id = malloc(sizeof(int32_t) * particles.count);
+    if(!h || !x || !y || !type || !id) {
+        fprintf(stderr, "Cannot read back export %s\n", name);
+        exit(1);
+    }
+
+    int mismatches = 0;
+    export_frame frame;
+    for(int round = 0; round < 2; round++) {
+        if(round) step();   // Publishes as well
+        uint64_t frames = export_read(h, &frame, x, y, type, id);
+        mismatches += frames != (uint64_t)round + 1 || frame.step != (uint64_t)step_count || frame.count != (uint32_t)particles.count;
+        for(int i = 0; i < particles.count; i++) {
+            mismatches += x[i] != particles.x[i] || y[i] != particles.y[i] || type[i] != particles.type[i] ||
+                          id[i] != particles.id[i];
+        }
+    }
+    int kept = export_buffer(h, 0)->step == 0 && export_buffer(h, 1)->step == (uint64_t)step_count;
+
+    // frames two ahead of the buffer it points to, as a reader sees it when
+    // the writer laps it between the two loads: the number returned has to
+    // be the copied frame's
+    exported->frames += 2;
+    int numbered = export_read(h, &frame, x, y, type, id) == 2;
+    exported->frames -= 2;
+
+    // A writer stopped halfway through the newest buffer
+    exported->sequence[1]++;
+    int torn = export_read(h, &frame, x, y, type, id) != 0;
+    exported->sequence[1]++;
+
+    export_close();
+    int closed = h->closed;
+    int fd = shm_open(name, O_RDONLY, 0);
+    int removed = fd < 0;
+    if(fd >= 0) close(fd);
+    munmap((void *)h, bytes);
+    free(x);
+    free(y);
+    free(type);
+    free(id);
+
+    int pass = !mismatches && kept && numbered && !torn && closed && removed;
+    printf("%s export: %d mismatched value(s), previous frame %s, frame number %s, torn frame %s, segment %s\n",
+           pass ? "PASS" : "FAIL", mismatches, kept ? "kept" : "lost", numbered ? "of the copy" : "stale",
+           torn ? "returned" : "refused", closed && removed ? "closed" : "left open");
+    params.export_name = NULL;
+    return !pass;
+}
+
+// Sends command over the control connection fd and keeps running the
+// simulation side (control_poll()) until the reply line arrives or two
+// seconds pass. Returns 0 on a reply, copied into reply without newline.
+int control_request(int fd, const char *command, char *reply, int size) {
+    char line[CONTROL_LINE];
+    int length = snprintf(line, sizeof line, "%s\n", command);
+    if(send(fd, line, length, MSG_NOSIGNAL) != length) return 1;
+    int got = 0;
+    for(int attempt = 0; attempt < 2000; attempt++) {
+        control_poll();
+        ssize_t part = recv(fd, reply + got, size - 1 - got, MSG_DONTWAIT);
+        if(part > 0) got += part;
+        char *newline = memchr(reply, '\n', got);
+        if(newline) {
+            *newline = 0;
+            return 0;
+        }
+        usleep(1000);
+    }
+    return 1;
+}
+
+// Checks the control channel from a client in this process: stats, set
+// (accepted and refused), pause and resume, a snapshot that loads back, a
+// burst of lines that fills the input buffer, and that closing removes the
+// socket. Returns the number of failures.
+int verify_control() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.num_particles = 500;
+    char path[64], snapshot[64];
+    snprintf(path, sizeof path, "/tmp/life-verify-%d.sock", (int)getpid());
+    snprintf(snapshot, sizeof snapshot, "/tmp/life-verify-%d.txt", (int)getpid());
+    params.control_path = path;
+    init_particles(13);
+    for(int s = 0; s < 5; s++) step();
+    float entry = interaction[2][1];
+    if(control_open()) return 1;
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof address)) {
+        fprintf(stderr, "Cannot connect to %s\n", path);
+        exit(1);
+    }
+    char reply[CONTROL_LINE], expected[64];
+    int failures = 0;
+    snprintf(expected, sizeof expected, "{\"step\":%ld,", step_count);
+    failures += control_request(fd, "stats", reply, sizeof reply) || strncmp(reply, expected, strlen(expected));
+    failures += control_request(fd, "set temperature 0.25", reply, sizeof reply) || strcmp(reply, "ok") ||
+                params.temperature != 0.25f;
+    failures += control_request(fd, "set dt 0", reply, sizeof reply) || strncmp(reply, "error", 5) || params.dt != TIME_STEP;
+    failures += control_request(fd, "set radius_min 5", reply, sizeof reply) || strcmp(reply, "ok") ||
+                params.radius_min_squared != 25.0f;
+    failures += control_request(fd, "set interaction 2 1 -5", reply, sizeof reply) || strcmp(reply, "ok") ||
+                interaction[2][1] != -5;
+    failures += control_request(fd, "pause", reply, sizeof reply) || strcmp(reply, "ok") || !control.paused;
+    failures += control_request(fd, "resume", reply, sizeof reply) || strcmp(reply, "ok") || control.paused;
+    failures += control_request(fd, "snapshot /nonexistent/dir/file", reply, sizeof reply) || strncmp(reply, "error", 5);
+    failures += control_request(fd, "snapshot", reply, sizeof reply) || strncmp(reply, "error", 5);
+    char command[128];
+    snprintf(command, sizeof command, "snapshot %s", snapshot);
+    failures += control_request(fd, command, reply, sizeof reply) || strncmp(reply, "ok", 2);
+
+    // Lines arriving faster than the simulation runs them fill the input
+    // buffer behind a queued command; the connection must wait, not close
+    char burst[2 * CONTROL_LINE];
+    int length = snprintf(burst, sizeof burst, "pause\n");
+    for(int r = 0; r < 6; r++) length += snprintf(burst + length, sizeof burst - length, "resume%93s\n", "");
+    failures += send(fd, burst, length, MSG_NOSIGNAL) != length;
+    usleep(20000);
+    int answers = 0;
+    for(int attempt = 0; attempt < 2000 && answers < 7; attempt++) {
+        control_poll();
+        ssize_t part;
+        while((part = recv(fd, reply, sizeof reply, MSG_DONTWAIT)) > 0) {
+            for(ssize_t b = 0; b < part; b++) answers += reply[b] == '\n';
+        }
+        if(part == 0) break;
+        usleep(1000);
+    }
+    failures += answers != 7 || control.paused;
+    close(fd);
+    control_close();
+    struct stat info;
+    failures += !lstat(path, &info);
+
+    // The snapshot reloads to the same particles, in id order
+    float x0 = particles.x[particle_with_id(0)], y0 = particles.y[particle_with_id(0)];
+    int count = particles.count;
+    failures += load_particles(snapshot) || particles.count != count || particles.x[0] != x0 || particles.y[0] != y0;
+    remove(snapshot);
+
+    // interaction is a global the later checks rely on
+    interaction[2][1] = entry;
+    params.control_path = NULL;
+    printf("%s control: %d failed request(s)\n", failures ? "FAIL" : "PASS", failures);
+    return failures ? 1 : 0;
+}
+
+// Checks the far field of the level of detail mode: after a clustered run
+// has formed aggregates, the forces on the free particles must match the
+// exact all-pairs forces to within 5% of their rms magnitude. Returns the
+// number of failures.
+int verify_lod() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.lod = 1;
+    params.init = INIT_CLUSTERED;
+    params.num_particles = 2000;
+    params.width = params.height = 2000;
+    init_particles(3);
+    for(int s = 0; s < 300; s++) step();
+
+    compute_forces();
+    float *lod_fx = malloc(sizeof(float) * particles.count);
+    float *lod_fy = malloc(sizeof(float) * particles.count);
+    if(!lod_fx || !lod_fy) {
+        fprintf(stderr, "Cannot allocate %d forces\n", particles.count);
+        exit(1);
+    }
+    memcpy(lod_fx, particles.fx, sizeof(float) * particles.count);
+    memcpy(lod_fy, particles.fy, sizeof(float) * particles.count);
+    params.lod = 0;
+    compute_forces();
+
+    double error = 0, magnitude = 0;
+    for(int f = 0; f < lod_free_count; f++) {
+        int i = lod_free[f];
+        float dx = lod_fx[i] - particles.fx[i];
+        float dy = lod_fy[i] - particles.fy[i];
+        error += dx * dx + dy * dy;
+        magnitude += particles.fx[i] * particles.fx[i] + particles.fy[i] * particles.fy[i];
+    }
+    free(lod_fx);
+    free(lod_fy);
+
+    float relative = lod_free_count ? sqrtf(error / magnitude) : 0;
+    int pass = aggregate_count > 0 && relative <= 0.05f;
+    printf("%s lod far field: %d aggregate(s), rms error %g of the rms force\n", pass ? "PASS" : "FAIL",
+           aggregate_count, relative);
+    return !pass;
+}
+
+// Checks activity tracking on a settled clustered run: dormant sleepers
+// must keep their positions through a step, and moving a particle next to
+// a sleeper must wake it. Returns the number of failures.
+int verify_sleep() {
+    int threads = params.threads;
+    params = default_params;
+    params.threads = threads;
+    params.sleep = 1;
+    params.init = INIT_CLUSTERED;
+    init_particles(5);
+    for(int s = 0; s < 1000; s++) step();
+
+    int sleeper = -1, moved = 0;
+    float *x = malloc(sizeof(float) * particles.count);
+    float *y = malloc(sizeof(float) * particles.count);
+    int *was_dormant = malloc(sizeof(int) * particles.count);
+    if(!x || !y || !was_dormant) {
+        fprintf(stderr, "Cannot allocate %d positions\n", particles.count);
+        exit(1);
+    }
+    for(int i = 0; i < particles.count; i++) {
+        x[i] = particles.x[i];
+        y[i] = particles.y[i];
+        was_dormant[i] = dormant(i);
+    }
+    step();
+    for(int i = 0; i < particles.count; i++) {
+        if(!was_dormant[i]) continue;
+        moved += particles.x[i] != x[i] || particles.y[i] != y[i];
+        if(sleeper < 0 && particles.quiet[i] >= SLEEP_STEPS) sleeper = i;
+    }
+    free(x);
+    free(y);
+    free(was_dormant);
+
+    // Drop an awake particle right next to the sleeper
+    int woken = 0;
+    if(sleeper >= 0) {
+        int j = sleeper == 0 ? 1 : 0;
+        particles.x[j] = wrap_coordinate(particles.x[sleeper] + 0.5f * SLEEP_WAKE, params.width);
+        particles.y[j] = particles.y[sleeper];
+        particles.moved[j] = 2 * SLEEP_THRESHOLD;
+        update_activity();
+        woken = particles.quiet[sleeper] == 0;
+    }
+
+    int pass = sleeper >= 0 && !moved && woken;
+    printf("%s sleep: %.1f%% asleep, %d dormant particle(s) moved, sleeper %s\n", pass ? "PASS" : "FAIL",
+           100 * sleeping_fraction, moved, woken ? "woken" : "not woken");
+    return !pass;
+}
+
+// Runs every golden case and compares the sampled particles (minimum-image
+// distance, since a particle may sit on either side of the periodic seam).
+// Returns the process exit status.
+int verify() {
+    int failures = verify_wrap();
+    failures += verify_repair();
+    failures += verify_timestep();
+    failures += verify_kernels();
+    failures += verify_sort();
+    failures += verify_precision();
+    failures += verify_diagnostics();
+    failures += verify_fused_potential();
+    failures += verify_rdf();
+    failures += verify_clusters();
+    failures += verify_tracking();
+    failures += verify_sweep();
+    failures += verify_export();
+    failures += verify_control();
+    failures += verify_lod();
+    failures += verify_sleep();
+    int cases = sizeof golden_cases / sizeof *golden_cases;
+
+    for(int c = 0; c < cases; c++) {
+        const golden_case *g = &golden_cases[c];
+        run_golden(g->engine, g->inertial, g->seed);
+
+        float error = 0;
+        for(int k = 0; k < GOLDEN_SAMPLES; k++) {
+            int i = particle_with_id(k * particles.count / GOLDEN_SAMPLES);
+            float dx = min_image(particles.x[i] - g->x[k], params.width);
+            float dy = min_image(particles.y[i] - g->y[k], params.height);
+            float d = sqrtf(dx * dx + dy * dy);
+            error = d > error || d != d ? d : error;
+        }
+        int pass = error <= g->tolerance;
+        printf("%s %s %s seed %u: max error %g (tolerance %g)\n", pass ? "PASS" : "FAIL",
+               engine_names[g->engine], g->inertial ? "verlet" : "overdamped", g->seed, error, g->tolerance);
+        failures += !pass;
+    }
+
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
+
+// Runs steps steps without a window and prints throughput
+int run_headless(long steps) {
+    struct timespec start, end;
+    cell_seconds = 0;
+    grid.rebuilds = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long done = 0;
+    for(; done < steps; done++) {
+        if(control.listener >= 0 && control_wait()) break;
+        step();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("engine %s (%s kernels): %ld steps, simulated time %g, %.3f s, %.1f steps/s\n",
+           engine_names[params.engine], params.engine == ENGINE_SCALAR ? "generic" : kernels->name,
+           step_count, sim_time, seconds, done / seconds);
+    if(params.lod) {
+        int aggregated = particles.count - lod_free_count;
+        printf("level of detail: %d aggregate(s) holding %d of %d particles\n", aggregate_count, aggregated, particles.count);
+    }
+    if(params.engine == ENGINE_CELLS) printf("cell list (%s): %.3f ms per step, %ld rebuild(s)\n",
+                                            cell_update_names[params.cell_update], 1e3 * cell_seconds / steps, grid.rebuilds);
+    if(params.sleep) printf("sleeping: %.1f%% of the particles\n", 100 * sleeping_fraction);
+    return 0;
+}
+
+// Colour of every species as 0xRRGGBB, shared by all renderers. The first
+// three are the original red, green and blue; species beyond that get fully
+// saturated hues spaced by the golden ratio so neighbours stay distinct.
+unsigned int palette_rgb[NUM_TYPES];
+
+// Pixel values of palette_rgb on the display, allocated once at window setup
+// so drawing a particle is a table lookup instead of a branch on its type
+unsigned long palette_pixels[NUM_TYPES];
+
+void init_palette() {
+    const unsigned int base[3] = { 0xFF0000, 0x00FF00, 0x0000FF };
+    for(int t = 0; t < NUM_TYPES; t++) {
+        if(t < 3) {
+            palette_rgb[t] = base[t];
+            continue;
+        }
+        // HSV (hue, 1, 1) to RGB
+        float hue = fmodf(t * 0.618034f, 1.0f) * 6.0f;
+        float fraction = hue - floorf(hue);
+        int up = (int)(255 * fraction);
+        int down = 255 - up;
+        int r, g, b;
+        switch((int)hue) {
+            case 0: r = 255; g = up; b = 0; break;
+            case 1: r = down; g = 255; b = 0; break;
+            case 2: r = 0; g = 255; b = up; break;
+            case 3: r = 0; g = down; b = 255; break;
+            case 4: r = up; g = 0; b = 255; break;
+            default: r = 255; g = 0; b = down; break;
+        }
+        palette_rgb[t] = (r << 16) | (g << 8) | b;
+    }
+}
+
+// Overrides the palette from a comma separated list of RRGGBB hex colours,
+// first entry for species 0. Returns -1 on a malformed entry.
+int parse_palette(const char *list) {
+    for(int t = 0; t < NUM_TYPES && *list; t++) {
+        char *end;
+        unsigned long rgb = strtoul(list, &end, 16);
+        if(end == list || rgb > 0xFFFFFF || (*end && *end != ',')) return -1;
+        palette_rgb[t] = rgb;
+        list = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Allocates one pixel per species in colormap
+void alloc_palette(Display *display, Colormap colormap) {
+    for(int t = 0; t < NUM_TYPES; t++) {
+        XColor color;
+        // XColor channels are 16 bit: 0xAB becomes 0xABAB
+        color.red = ((palette_rgb[t] >> 16) & 0xFF) * 0x101;
+        color.green = ((palette_rgb[t] >> 8) & 0xFF) * 0x101;
+        color.blue = (palette_rgb[t] & 0xFF) * 0x101;
+        XAllocColor(display, colormap, &color);
+        palette_pixels[t] = color.pixel;
+    }
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [--headless STEPS] [--engine scalar|simd|threaded|cells] [--seed N]\n"
+                    "          [--threads N] [--generic] [--cell-update rebuild|incremental|sorted|species] [--lod] [--sleep] [--inertial]\n"
+                    "          [--diagnostics N] [--diagnostics-file FILE] [--rdf N] [--rdf-file FILE]\n"
+                    "          [--clustering N] [--clustering-file FILE] [--tracking] [--tracking-file FILE]\n"
+                    "          [--temperature T] [--adaptive] [--block-levels N] [--verify] [--golden]\n"
+                    "          [--sweep SPEC] [--sweep-results FILE] [--jobs N]\n"
+                    "          [--export NAME] [--export-interval N] [--watch NAME] [--control SOCKET]\n"
+                    "          [--particles N] [--width W] [--height H] [--init uniform|clustered|disk|lattice]\n"
+                    "          [--clusters N] [--mix A,B,C] [--load FILE] [--palette RRGGBB,...]\n", program);
+}
 
 // Main function: Entry point of the program
-int main() {
-    // initial position for particles
-    srand(42);
-    for(int i = 0; i < NUM_PARTICLES; i++) {
-        particles[i].x = rand() % (WIDTH + 1);
-        particles[i].y = rand() % (HEIGHT + 1);
-        particles[i].type = i % 3;
+int main(int argc, char **argv) {
+    params = default_params;
+    unsigned seed = 42;
+    long headless_steps = -1;
+    int verify_mode = 0;
+    int golden_mode = 0;
+    const char *sweep_path = NULL;
+    const char *sweep_results = SWEEP_RESULTS;
+    int sweep_jobs = SWEEP_JOBS;
+    const char *watch_name = NULL;
+    init_palette();
+
+    // Command line options
+    for(int a = 1; a < argc; a++) {
+        if(!strcmp(argv[a], "--verify")) verify_mode = 1;
+        else if(!strcmp(argv[a], "--golden")) golden_mode = 1;
+        else if(!strcmp(argv[a], "--inertial")) params.inertial = 1;
+        else if(!strcmp(argv[a], "--adaptive")) params.adaptive = 1;
+        else if(!strcmp(argv[a], "--block-levels") && a + 1 < argc) params.block_levels = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--temperature") && a + 1 < argc) params.temperature = atof(argv[++a]);
+        else if(!strcmp(argv[a], "--headless") && a + 1 < argc) headless_steps = atol(argv[++a]);
+        else if(!strcmp(argv[a], "--seed") && a + 1 < argc) seed = strtoul(argv[++a], NULL, 10);
+        else if(!strcmp(argv[a], "--threads") && a + 1 < argc) params.threads = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--generic")) params.specialise = 0;
+        else if(!strcmp(argv[a], "--cell-update") && a + 1 < argc) {
+            const char *name = argv[++a];
+            params.cell_update = -1;
+            for(int u = 0; u < NUM_CELL_UPDATES; u++) if(!strcmp(name, cell_update_names[u])) params.cell_update = u;
+            if(params.cell_update < 0) {
+                fprintf(stderr, "Unknown cell update %s\n", name);
+                return 1;
+            }
+        }
+        else if(!strcmp(argv[a], "--lod")) params.lod = 1;
+        else if(!strcmp(argv[a], "--sleep")) params.sleep = 1;
+        else if(!strcmp(argv[a], "--diagnostics") && a + 1 < argc) params.diagnostics = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--diagnostics-file") && a + 1 < argc) params.diagnostics_path = argv[++a];
+        else if(!strcmp(argv[a], "--rdf") && a + 1 < argc) params.rdf = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--rdf-file") && a + 1 < argc) params.rdf_path = argv[++a];
+        else if(!strcmp(argv[a], "--clustering") && a + 1 < argc) params.clustering = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--clustering-file") && a + 1 < argc) params.clustering_path = argv[++a];
+        else if(!strcmp(argv[a], "--tracking")) params.tracking = 1;
+        else if(!strcmp(argv[a], "--tracking-file") && a + 1 < argc) params.tracking_path = argv[++a];
+        else if(!strcmp(argv[a], "--export") && a + 1 < argc) params.export_name = argv[++a];
+        else if(!strcmp(argv[a], "--export-interval") && a + 1 < argc) params.export_interval = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--watch") && a + 1 < argc) watch_name = argv[++a];
+        else if(!strcmp(argv[a], "--control") && a + 1 < argc) params.control_path = argv[++a];
+        else if(!strcmp(argv[a], "--sweep") && a + 1 < argc) sweep_path = argv[++a];
+        else if(!strcmp(argv[a], "--sweep-results") && a + 1 < argc) sweep_results = argv[++a];
+        else if(!strcmp(argv[a], "--jobs") && a + 1 < argc) sweep_jobs = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--particles") && a + 1 < argc) params.num_particles = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--width") && a + 1 < argc) params.width = atof(argv[++a]);
+        else if(!strcmp(argv[a], "--height") && a + 1 < argc) params.height = atof(argv[++a]);
+        else if(!strcmp(argv[a], "--clusters") && a + 1 < argc) params.clusters = atoi(argv[++a]);
+        else if(!strcmp(argv[a], "--load") && a + 1 < argc) {
+            params.init = INIT_FILE;
+            params.load_path = argv[++a];
+        }
+        else if(!strcmp(argv[a], "--palette") && a + 1 < argc) {
+            if(parse_palette(argv[++a])) {
+                fprintf(stderr, "Invalid palette %s\n", argv[a]);
+                return 1;
+            }
+        }
+        else if(!strcmp(argv[a], "--mix") && a + 1 < argc) {
+            // Comma separated fractions, one per species
+            char *next = argv[++a];
+            for(int t = 0; t < NUM_TYPES && *next; t++) {
+                params.mix[t] = strtof(next, &next);
+                if(*next == ',') next++;
+            }
+        }
+        else if(!strcmp(argv[a], "--init") && a + 1 < argc) {
+            const char *name = argv[++a];
+            params.init = -1;
+            for(int g = 0; g < INIT_FILE; g++) if(!strcmp(name, generator_names[g])) params.init = g;
+            if(params.init < 0) {
+                fprintf(stderr, "Unknown initial condition %s\n", name);
+                return 1;
+            }
+        }
+        else if(!strcmp(argv[a], "--engine") && a + 1 < argc) {
+            const char *name = argv[++a];
+            params.engine = -1;
+            for(int e = 0; e < NUM_ENGINES; e++) if(!strcmp(name, engine_names[e])) params.engine = e;
+            if(params.engine < 0) {
+                fprintf(stderr, "Unknown engine %s\n", name);
+                return 1;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(params.block_levels < 0 || params.block_levels > MAX_BLOCK_LEVELS) {
+        fprintf(stderr, "--block-levels needs 0 to %d levels\n", MAX_BLOCK_LEVELS);
+        return 1;
+    }
+    if(params.num_particles < 1) {
+        fprintf(stderr, "--particles needs at least 1 particle\n");
+        return 1;
+    }
+    if(non_finite(params.width) || non_finite(params.height) || params.width <= 0 || params.height <= 0) {
+        fprintf(stderr, "--width and --height need a positive size\n");
+        return 1;
+    }
+    if(params.clusters < 1) {
+        fprintf(stderr, "--clusters needs at least 1 cluster\n");
+        return 1;
+    }
+
+    if(params.lod && (params.engine != ENGINE_SIMD && params.engine != ENGINE_THREADED)) {
+        fprintf(stderr, "--lod needs the simd or threaded engine\n");
+        return 1;
+    }
+    if(params.lod && (params.inertial || params.block_levels > 0)) {
+        fprintf(stderr, "--lod needs the overdamped integrator\n");
+        return 1;
+    }
+
+    if(params.sleep && (params.inertial || params.block_levels > 0 || params.lod)) {
+        fprintf(stderr, "--sleep needs the overdamped integrator without --lod\n");
+        return 1;
+    }
+
+    if(params.export_interval < 1) {
+        fprintf(stderr, "--export-interval needs a positive step count\n");
+        return 1;
+    }
+
+    if(params.tracking && params.clustering <= 0) {
+        fprintf(stderr, "--tracking needs --clustering N\n");
+        return 1;
     }
 
+    if(verify_mode) return verify();
+    if(golden_mode) return print_golden();
+    if(sweep_path) return run_sweep(sweep_path, sweep_results, sweep_jobs);
+    if(watch_name) return watch_export(watch_name);
+
+    // initial position for particles
+    init_particles(seed);
+    if(params.diagnostics > 0 && diagnostics_open()) return 1;
+    if(params.clustering > 0 && clustering_open()) return 1;
+    if(params.tracking && tracking_open()) return 1;
+    if(params.export_name) {
+        if(export_open()) return 1;
+        atexit(export_close);
+    }
+    if(params.control_path) {
+        if(control_open()) return 1;
+        atexit(control_close);
+    }
+    if(headless_steps >= 0) return run_headless(headless_steps);
 
     // Step 1: Connect to the X11 display server
     // XOpenDisplay(NULL) uses the default display (e.g., :0 on local machine)
@@ -72,26 +5368,8 @@ int main() {
     // GC holds attributes like foreground color, line style; XCreateGC initializes defaults
     GC gc = XCreateGC(display, window, 0, NULL);  // 0: No initial values to set, NULL for defaults
 
-    // Step 7: Define and allocate white color for the pixel
-    XColor color1;
-    color1.red = 0xFFFF;
-    color1.green = 0;
-    color1.blue = 0;
-    XAllocColor(display, DefaultColormap(display, screen), &color1);
-
-    XColor color2;
-    color2.red = 0;
-    color2.green = 0xFFFF;
-    color2.blue = 0;
-    XAllocColor(display, DefaultColormap(display, screen), &color2);
-
-    XColor color3;
-    color3.red = 0;
-    color3.green = 0;
-    color3.blue = 0xFFFF;
-    XAllocColor(display, DefaultColormap(display, screen), &color3);
-
-    XSetForeground(display, gc, color1.pixel);
+    // Step 7: Allocate one pixel value per species from the palette
+    alloc_palette(display, DefaultColormap(display, screen));
 
     // Step 8: Event handling and animation loop variables
     XEvent event;          // Struct to hold incoming events
@@ -134,88 +5412,19 @@ int main() {
         XFillRectangle(display, window, gc, 0, 0, WIDTH, HEIGHT);
 
 
-        for(int i = 0; i < NUM_PARTICLES; i++) {
-            if(particles[i].type == 0) {
-                XSetForeground(display, gc, color1.pixel);
-            }
-            else if(particles[i].type == 1) {
-                XSetForeground(display, gc, color2.pixel);
-            }
-            else if (particles[i].type == 2) {
-                XSetForeground(display, gc, color3.pixel);
-            }
-            XFillRectangle(display, window, gc, particles[i].x - 1, particles[i].y - 1, 3, 3);
+        for(int i = 0; i < particles.count; i++) {
+            XSetForeground(display, gc, palette_pixels[particles.type[i]]);
+            // The domain is scaled to fit the window
+            XFillRectangle(display, window, gc, particles.x[i] * WIDTH / params.width - 1,
+                           particles.y[i] * HEIGHT / params.height - 1, 3, 3);
         }
         
-        for(int i = 0; i < NUM_PARTICLES; i++) {
-            float new_x = 0;
-            float new_y = 0;
-            
-            for(int j = 0; j < NUM_PARTICLES; j++) {
-                if(j == i) continue;
-
-                float x_pos_n = particles[i].x - particles[j].x;
-                float x_pos_jb = particles[i].x - particles[j].x + WIDTH;
-                float x_pos_ib = particles[i].x - particles[j].x - WIDTH;
-                float x_pos = x_pos_n * x_pos_n > x_pos_jb * x_pos_jb ? (x_pos_jb * x_pos_jb > x_pos_ib * x_pos_ib ? x_pos_ib : x_pos_jb) : (x_pos_n * x_pos_n > x_pos_ib * x_pos_ib ? x_pos_ib : x_pos_n);
-                float x_squared = x_pos * x_pos;
-
-                float y_pos_n = particles[i].y - particles[j].y;
-                float y_pos_jb = particles[i].y - particles[j].y + WIDTH;
-                float y_pos_ib = particles[i].y - particles[j].y - WIDTH;
-                float y_pos = y_pos_n * y_pos_n > y_pos_jb * y_pos_jb ? (y_pos_jb * y_pos_jb > y_pos_ib * y_pos_ib ? y_pos_ib : y_pos_jb) : (y_pos_n * y_pos_n > y_pos_ib * y_pos_ib ? y_pos_ib : y_pos_n);
-                float y_squared = y_pos * y_pos;
-
-                float r_squared = x_squared + y_squared;
-
-                float speed = COEFFICIENT / r_squared;
-
-                float coefficient = -1e4;
-
-                if(particles[i].type == 0 && particles[j].type == 0) {
-                    coefficient *= -1.0;
-                }
-                else if (particles[i].type == particles[j].type) {
-                    coefficient *= 1.0;
-                }
-
-                else if(particles[i].type == 0 && particles[j].type == 1) {
-                    coefficient *= 1.0;
-                }
-                else if(particles[i].type == 1 && particles[j].type == 0) {
-                    coefficient *= -1.0;
-                }
-
-                else if(particles[i].type == 0 && particles[j].type == 2) {
-                    coefficient *= -1.0;
-                }
-                else if(particles[i].type == 2 && particles[j].type == 0) {
-                    coefficient *= 1.0;
-                }
-
-                else if(particles[i].type == 1 && particles[j].type == 2) {
-                    coefficient *= 1.0;
-                }
-                else if(particles[i].type == 2 && particles[j].type == 1) {
-                    coefficient *= -1.0;
-                }
-                else coefficient = 0;
-
-                if(coefficient < 0.0 && r_squared < SQUARED_RADIUS_MIN) continue;
-
-                new_x += coefficient * speed * x_pos / sqrt(r_squared);
-                new_y += coefficient * speed * y_pos / sqrt(r_squared);
-            }
-            particles[i].x += new_x;
-            particles[i].y += new_y;
-            
-            if(particles[i].x > WIDTH) particles[i].x -= WIDTH; 
-            if(particles[i].x < 0) particles[i].x += WIDTH; 
-            if(particles[i].y > HEIGHT) particles[i].y -= WIDTH; 
-            if(particles[i].y < 0) particles[i].y += HEIGHT; 
-
-            if(DEBUG) printf("New speed for particle %d... x : %f and y : %f... Pos x : %f, pos y : %f\n", i, new_x, new_y, particles[i].x, particles[i].y);
+        // Commands of the control channel; a paused run keeps drawing
+        if(control.listener >= 0) {
+            control_poll();
+            if(control.stop) running = 0;
         }
+        if(!control.paused) step();
 
         // Step 5: Flush changes to display
         // XFlush: Sends all pending drawing requests to X server immediately